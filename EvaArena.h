@@ -0,0 +1,138 @@
+//
+// Created by Retros on 2023/3/25.
+//
+
+#ifndef RETROSEVAVM_EVAARENA_H
+#define RETROSEVAVM_EVAARENA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "Logger.h"
+
+/**
+ * Size of an arena chunk.
+ */
+const size_t ARENA_CHUNK_SIZE = 64 * 1024;
+
+/**
+ * Bump-pointer arena.
+ *
+ * Objects are carved out of large chunks and are never freed one by
+ * one: reset() releases all of them at once by rewinding to the first
+ * chunk. The chunks are kept for reuse. Objects owning other memory
+ * must be registered with finalizeOnReset() to have their destructor
+ * run; nothing else is visited on reset.
+ */
+class EvaArena {
+public:
+    EvaArena() = default;
+
+    ~EvaArena() {
+        reset();
+        for (auto chunk : chunks) {
+            std::free(chunk.memory);
+        }
+    }
+
+    EvaArena(const EvaArena&) = delete;
+    EvaArena& operator=(const EvaArena&) = delete;
+
+    /**
+     * Allocates uninitialized memory.
+     */
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        auto aligned = (cursor + alignment - 1) & ~(alignment - 1);
+
+        if (current == chunks.size() || aligned + size > chunks[current].size) {
+            nextChunk(size + alignment);
+            aligned = (cursor + alignment - 1) & ~(alignment - 1);
+        }
+
+        cursor = aligned + size;
+        allocated += size;
+        return chunks[current].memory + aligned;
+    }
+
+    /**
+     * Constructs an object in the arena.
+     */
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Runs the destructor of the object on reset.
+     */
+    template <typename T>
+    void finalizeOnReset(T* object) {
+        finalizers.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+    }
+
+    /**
+     * Releases all objects.
+     */
+    void reset() {
+        for (auto& finalizer : finalizers) {
+            finalizer.second(finalizer.first);
+        }
+        finalizers.clear();
+
+        current = 0;
+        cursor = 0;
+        allocated = 0;
+    }
+
+    /**
+     * Bytes allocated since the last reset.
+     */
+    size_t bytesAllocated() const { return allocated; }
+
+private:
+    struct Chunk {
+        char* memory;
+        size_t size;
+    };
+
+    /**
+     * Moves to the next chunk that fits `size` bytes,
+     * allocating one if needed.
+     */
+    void nextChunk(size_t size) {
+        if (current < chunks.size()) {
+            current++;
+        }
+        while (current < chunks.size() && chunks[current].size < size) {
+            current++;
+        }
+        if (current == chunks.size()) {
+            auto chunkSize = std::max(size, ARENA_CHUNK_SIZE);
+            auto memory = (char*)std::malloc(chunkSize);
+            if (memory == nullptr) {
+                DIE << "EvaArena: out of memory.";
+            }
+            chunks.push_back({memory, chunkSize});
+        }
+        cursor = 0;
+    }
+
+    /**
+     * Chunks, the current one, and the position in it.
+     */
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    size_t cursor = 0;
+
+    size_t allocated = 0;
+
+    /**
+     * Objects to destroy on reset.
+     */
+    std::vector<std::pair<void*, void (*)(void*)>> finalizers;
+};
+
+#endif //RETROSEVAVM_EVAARENA_H
@@ -10,9 +10,14 @@
 #include "OpCode.h"
 #include "parser/EvaParser.h"
 #include "disassembler/EvaDisassembler.h"
+#include "verifier/EvaVerifier.h"
+#include "optimizer/EvaOptimizer.h"
+#include "closure/EvaCaptureAnalysis.h"
 
 
+#include <algorithm>
 #include <map>
+#include <set>
 #include <string>
 
 
@@ -33,12 +38,13 @@
 
 
 
-// Generic binary operator: (+ 1 2) OP_CONST, OP_CONST, OP_ADD
-#define GEN_BINARY_OP(op)  \
-    do {                   \
-        gen(exp.list[1]);  \
-        gen(exp.list[2]);  \
-        emit(op);          \
+// Generic binary operator: (+ 1 2) OP_PUSH_SMALLINT8, OP_PUSH_SMALLINT8, OP_ADD_NUM
+// The number-specialized version is used when both operands are numbers.
+#define GEN_BINARY_OP(op)                                   \
+    do {                                                    \
+        checkBinaryOperands(exp);                           \
+        genOperands(exp, 1);                                \
+        emit(isNumberOperands(exp) ? op##_NUM : op);        \
     } while (false)
 
 
@@ -48,7 +54,9 @@
 class EvaCompiler {
 public:
     EvaCompiler(std::shared_ptr<Global> global)
-        : global(global), disassembler(std::make_unique<EvaDisassembler>(global)) {}
+        : global(global),
+          disassembler(std::make_unique<EvaDisassembler>(global)),
+          verifier(std::make_unique<EvaVerifier>(global)) {}
 
     /**
      * Main compile API.
@@ -56,11 +64,18 @@ public:
     CodeObject* compile(const Exp& exp) {
         // Allocate new code object;
         co = AS_CODE(ALLOC_CODE("main"));
+        functions = {co};
+        temporaries = 0;
+        currentLine = 0;
+
+        boxedDeclarations = captureAnalysis.findBoxed(exp);
 
         gen(exp);
 
         emit(OP_HALT);
 
+        finishCode(co);
+
         return co;
     }
 
@@ -68,14 +83,27 @@ public:
      * Main compile loop.
      */
     void gen(const Exp& exp) {
+        // Computed before the loop (see genWhile).
+        auto loopLocal = loopLocals.find(&exp);
+        if (loopLocal != loopLocals.end()) {
+            emit(OP_GET_LOCAL);
+            emit(loopLocal->second);
+            return;
+        }
+
+        // Code is attributed to the innermost expression with a location.
+        auto outerLine = currentLine;
+        if (exp.span.startLine > 0) {
+            currentLine = exp.span.startLine;
+        }
+
         switch (exp.type) {
             /**
              * -------------------------------------------------------
              * Numbers.
              */
             case ExpType::NUMBER: {
-                emit(OP_CONST);
-                emit(numericConstIdx(exp.number));
+                emitInt(exp.number);
                 break;
             }
 
@@ -98,8 +126,7 @@ public:
                  * Boolean
                  */
                 if ( exp.string == "true" || exp.string == "false" ) {
-                    emit(OP_CONST);
-                    emit(booleanConstIdx(exp.string == "true") ? true : false);
+                    emitBoolean(exp.string == "true");
                 } else {
                     // Variables:
                     auto varName = exp.string;
@@ -107,20 +134,35 @@ public:
                     // 1. Local Vars:
 
                     auto localIndex = co->getLocalIndex(varName);
+                    auto upvalueIndex = localIndex == -1 ? resolveUpvalue(functions.size() - 1, varName) : -1;
 
                     if (localIndex != -1) {
-                        emit(OP_GET_LOCAL);
-                        emit(localIndex);
+                        auto& local = co->locals[localIndex];
+                        emit(local.isBoxed ? OP_GET_BOXED : OP_GET_LOCAL);
+                        emit(local.slot);
+                    }
+
+                    // 2. Variables of the enclosing functions:
+                    else if (upvalueIndex != -1) {
+                        emit(OP_GET_UPVALUE);
+                        emit(upvalueIndex);
                     }
 
-                    // 2. Global Variables:
+                    // 3. Global Variables:
                     else {
                         if (!global->exists(exp.string)) {
                             DIE << "[EvaCompiler]: Reference error: " << exp.string;
                         }
 
-                        emit(OP_GET_GLOBAL);
-                        emit(global->getGlobalIndex(exp.string));
+                        auto& globalVar = global->get(global->getGlobalIndex(exp.string));
+
+                        // 4. Global constants are inlined:
+                        if (globalVar.isConst) {
+                            emitValue(globalVar.value);
+                        } else {
+                            emit(OP_GET_GLOBAL);
+                            emit(global->getGlobalIndex(exp.string));
+                        }
                     }
                 }
                 break;
@@ -131,6 +173,13 @@ public:
              * List.
              */
             case ExpType::LIST: {
+                // Constant expressions are computed at compile time.
+                EvaValue constant;
+                if (evalConstant(exp, constant)) {
+                    emitValue(constant);
+                    break;
+                }
+
                 auto tag = exp.list[0];
 
                 /**
@@ -160,9 +209,9 @@ public:
                     // -------------------------------------------------------
                     // Compare operations.
                     else if (compareOps_.count(op) != 0) {
-                        gen(exp.list[1]);
-                        gen(exp.list[2]);
-                        emit(OP_COMPARE);
+                        checkBinaryOperands(exp);
+                        genOperands(exp, 1);
+                        emit(isNumberOperands(exp) ? OP_COMPARE_NUM : OP_COMPARE);
                         emit(compareOps_[op]);
                     }
 
@@ -172,16 +221,14 @@ public:
                     /**
                      * (if <test> <consequent> <alternate>)
                      */
-                    if (op == "if") {
-                        gen(exp.list[1]);
-
-                        // Else branch. Init with 0 address, will be patched.
-                        emit(OP_JMP_IF_FALSE);
-                        // we use 2-byte address
-                        emit(0);
-                        emit(0);
+                    else if (op == "if") {
+                        if (exp.list.size() != 3 && exp.list.size() != 4) {
+                            DIE << "[EvaCompiler]: invalid if, expected (if <test> <consequent> <alternate>)";
+                        }
 
-                        auto elseJmpAddr = getOffset() - 2;
+                        // Else branch. Init with 0 addresses, will be patched.
+                        std::vector<size_t> elseJmpAddrs;
+                        genTest(exp.list[1], false, elseJmpAddrs);
 
                         // Emit <consequent>
                         gen(exp.list[2]);
@@ -193,13 +240,18 @@ public:
 
                         auto endAddr = getOffset() - 2;
 
-                        // patch the else branch address.
+                        // patch the else branch addresses.
                         auto elseBranchAddr = getOffset();
-                        patchJumpAddress(elseJmpAddr, elseBranchAddr);
+                        for (auto elseJmpAddr : elseJmpAddrs) {
+                            patchJumpAddress(elseJmpAddr, elseBranchAddr);
+                        }
 
-                        // Emit <alternate> if we have it.
+                        // Emit <alternate> if we have it, otherwise
+                        // the value is false (keeps the stack balanced).
                         if (exp.list.size() == 4) {
                             gen(exp.list[3]);
+                        } else {
+                            emitBoolean(false);
                         }
 
                         // Patch the end.
@@ -207,45 +259,58 @@ public:
                         patchJumpAddress(endAddr, endBranchAddr);
                     }
 
-                    // --------------------------------------
-                    // While loop:
-
                     /**
-                     * (while <test> <body>)
+                     * (switch <key> (<k1> <body1>) ... (else <alternate>))
                      */
+                    else if (op == "switch") {
+                        genSwitch(exp);
+                    }
 
-                    else if (op == "while") {
-                        auto loopStartAddr = getOffset();
-
-                        // Emit <test>
-                        gen(exp.list[1]);
+                    // -------------------------------------------------------
+                    // Logical operations.
 
-                        // Loop end. Init with 0 address, will be patched.
-                        emit(OP_JMP_IF_FALSE);
+                    /**
+                     * (and <test1> ... <testN>), (or <test1> ... <testN>), (not <test>)
+                     * Short-circuit, evaluate to true or false.
+                     */
+                    else if (op == "and" || op == "or" || op == "not") {
+                        std::vector<size_t> falseJmpAddrs;
+                        genTest(exp, false, falseJmpAddrs);
 
-                        // 2-byte addresses:
+                        emitBoolean(true);
+                        emit(OP_JMP);
                         emit(0);
                         emit(0);
+                        auto endAddr = getOffset() - 2;
 
-                        auto loopEndJmpAddr = getOffset() - 2;
-
-                        // Emit <body>
-                        gen(exp.list[2]);
+                        auto falseAddr = getOffset();
+                        for (auto falseJmpAddr : falseJmpAddrs) {
+                            patchJumpAddress(falseJmpAddr, falseAddr);
+                        }
+                        emitBoolean(false);
 
-                        // Goto loop start:
-                        emit(OP_JMP);
+                        patchJumpAddress(endAddr, getOffset());
+                    }
 
-                        emit(0);
-                        emit(0);
+                    // --------------------------------------
+                    // While loop:
 
-                        patchJumpAddress(getOffset() - 2, loopStartAddr);
+                    /**
+                     * (while <test> <body>)
+                     */
 
-                        // Patch the end.
-                        auto loopEndAddr = getOffset() + 1;
-                        patchJumpAddress(loopEndJmpAddr, loopEndAddr);
+                    else if (op == "while") {
+                        genWhile(exp);
                     }
 
 
+                    /**
+                     * (for <var> <start> <end> <step> <body>)
+                     */
+                    else if (op == "for") {
+                        genFor(exp);
+                    }
+
                     // --------------------------------------
                     // Variable declaration: (var x (+ y 10))
                     else if (op == "var") {
@@ -254,10 +319,12 @@ public:
 
                         // Initializer
                         gen(exp.list[2]);
+                        auto isNumber = isNumberExp(exp.list[2]);
 
 
                         // 1. Global vars:
                         if (isGlobalScope()) {
+                            checkNotConst(varName);
                             global->define(exp.list[1].string);
                             emit(OP_SET_GLOBAL);
                             emit(global->getGlobalIndex(exp.list[1].string));
@@ -265,9 +332,12 @@ public:
 
                         // 2. Local vars:
                         else {
-                            co->addLocal(varName);
+                            auto isBoxed = boxedDeclarations.count(&exp) != 0;
+                            if (isBoxed) {
+                                emit(OP_BOX);
+                            }
                             emit(OP_SET_LOCAL);
-                            emit(co->getLocalIndex(varName));
+                            emit(declareLocal(varName, isNumber, isIntExp(exp.list[2]), isBoxed));
                         }
                     }
 
@@ -278,10 +348,35 @@ public:
                         gen(exp.list[2]);
 
                         auto localIndex = co->getLocalIndex(varName);
+                        auto upvalueIndex =
+                                localIndex == -1 ? resolveUpvalue(functions.size() - 1, varName) : -1;
+
+                        if (localIndex != -1 && co->locals[localIndex].isBoxed) {
+                            emit(OP_SET_BOXED);
+                            emit(co->locals[localIndex].slot);
+                        }
+
+                        else if (localIndex != -1) {
+                            // Once assigned a value of unknown type,
+                            // the variable is not a number anymore.
+                            auto& local = co->locals[localIndex];
+                            local.isNumber = local.isNumber && isNumberExp(exp.list[2]);
+                            local.isInt = local.isInt && isIntExp(exp.list[2]);
 
-                        if (localIndex != -1) {
                             emit(OP_SET_LOCAL);
-                            emit(localIndex);
+                            emit(local.slot);
+
+                            emitInductionUpdates(varName, exp.list[2]);
+                        }
+
+                        // Captured variables that are assigned are boxed.
+                        else if (upvalueIndex != -1) {
+                            if (!co->upvalues[upvalueIndex].isBoxed) {
+                                DIE << "[EvaCompiler]: cannot assign " << varName << " captured by "
+                                    << co->name;
+                            }
+                            emit(OP_SET_UPVALUE);
+                            emit(upvalueIndex);
                         }
 
                         else {
@@ -289,6 +384,7 @@ public:
                             if (globalIndex == -1) {
                                 DIE << "Reference error: " << varName << " is not defined.";
                             }
+                            checkNotConst(varName);
                             emit(OP_SET_GLOBAL);
                             emit(globalIndex);
                         }
@@ -310,20 +406,704 @@ public:
                             if ( !isLast && !isLocalDeclaration ) {
                                 emit(OP_POP);
                             }
+
+                            // The value of a boxed variable, not its box.
+                            if (isLast && isLocalDeclaration && co->locals.back().isBoxed) {
+                                emit(OP_GET_BOXED);
+                                emit(co->locals.back().slot);
+                            }
                         }
                         scopeExit();
                     }
+
+                    // -------------------------------------------------------
+                    // Arrays.
+
+                    /**
+                     * (array <value1> ... <valueN>)
+                     */
+                    else if (op == "array") {
+                        auto count = exp.list.size() - 1;
+                        if (count > 255) {
+                            DIE << "[EvaCompiler]: array literal too long: " << count;
+                        }
+                        genOperands(exp, 1);
+                        emit(OP_ARRAY);
+                        emit(count);
+                    }
+
+                    // -------------------------------------------------------
+                    // Maps.
+
+                    /**
+                     * (map <key1> <value1> ... <keyN> <valueN>)
+                     */
+                    else if (op == "map") {
+                        auto count = (exp.list.size() - 1) / 2;
+                        if ((exp.list.size() - 1) % 2 != 0 || count > 255) {
+                            DIE << "[EvaCompiler]: invalid map literal";
+                        }
+                        genOperands(exp, 1);
+                        emit(OP_MAP);
+                        emit(count);
+                    }
+
+                    /**
+                     * (has <map> <key>)
+                     */
+                    else if (op == "has") {
+                        if (exp.list.size() != 3) {
+                            DIE << "[EvaCompiler]: invalid has, expected (has <map> <key>)";
+                        }
+                        genOperands(exp, 1);
+                        emit(OP_HAS_KEY);
+                    }
+
+                    /**
+                     * (del <map> <key>)
+                     */
+                    else if (op == "del") {
+                        if (exp.list.size() != 3) {
+                            DIE << "[EvaCompiler]: invalid del, expected (del <map> <key>)";
+                        }
+                        genOperands(exp, 1);
+                        emit(OP_DELETE_KEY);
+                    }
+
+                    /**
+                     * (get <array> <index>), (get <map> <key>)
+                     */
+                    else if (op == "get") {
+                        if (exp.list.size() != 3) {
+                            DIE << "[EvaCompiler]: invalid get, expected (get <collection> <key>)";
+                        }
+                        genOperands(exp, 1);
+                        emit(OP_GET_INDEX);
+                    }
+
+                    /**
+                     * (put <array> <index> <value>), (put <map> <key> <value>)
+                     */
+                    else if (op == "put") {
+                        if (exp.list.size() != 4) {
+                            DIE << "[EvaCompiler]: invalid put, expected (put <collection> <key> <value>)";
+                        }
+                        genOperands(exp, 1);
+                        emit(OP_SET_INDEX);
+                    }
+
+                    // -------------------------------------------------------
+                    // Functions.
+
+                    /**
+                     * (lambda (<param1> ... <paramN>) <body>)
+                     */
+                    else if (op == "lambda") {
+                        if (exp.list.size() != 3) {
+                            DIE << "[EvaCompiler]: invalid lambda, expected (lambda (<params>) <body>)";
+                        }
+                        genFunction("lambda", exp.list[1], exp.list[2]);
+                    }
+
+                    /**
+                     * (def <name> (<param1> ... <paramN>) <body>)
+                     */
+                    else if (op == "def") {
+                        genDef(exp);
+                    }
+
+                    // -------------------------------------------------------
+                    // Function calls.
+                    else {
+                        genCall(exp);
+                    }
+                }
+
+                else {
+                    genCall(exp);
                 }
                 break;
             }
 
         }
+
+        currentLine = outerLine;
+    }
+
+    /**
+     * Function call: (fn <arg1> ... <argN>)
+     * The arguments stay on the stack, the callee reads them in place.
+     */
+    void genCall(const Exp& exp) {
+        auto argc = exp.list.size() - 1;
+        if (argc > 255) {
+            DIE << "[EvaCompiler]: too many arguments: " << argc;
+        }
+
+        genOperands(exp, 0);
+
+        emit(OP_CALL);
+        emit(argc);
+    }
+
+    /**
+     * Math and comparisons take two operands: (<op> <a> <b>).
+     */
+    void checkBinaryOperands(const Exp& exp) {
+        if (exp.list.size() != 3) {
+            auto& op = exp.list[0].string;
+            DIE << "[EvaCompiler]: invalid " << op << ", expected (" << op << " <a> <b>)";
+        }
+    }
+
+    /**
+     * Operands from `first` on: each stays on the stack (a temporary)
+     * while the next ones are computed.
+     */
+    void genOperands(const Exp& exp, size_t first) {
+        for (auto i = first; i < exp.list.size(); i++) {
+            gen(exp.list[i]);
+            temporaries++;
+        }
+        temporaries -= exp.list.size() - first;
+    }
+
+    /**
+     * Function definition: a global function at the top level,
+     * a local one otherwise. A local function is declared before
+     * its body, which can call it (then it's captured as a box).
+     */
+    void genDef(const Exp& exp) {
+        if (exp.list.size() != 4 || exp.list[1].type != ExpType::SYMBOL) {
+            DIE << "[EvaCompiler]: invalid def, expected (def <name> (<params>) <body>)";
+        }
+        auto& name = exp.list[1].string;
+
+        if (isGlobalScope()) {
+            checkNotConst(name);
+            global->define(name);
+            genFunction(name, exp.list[2], exp.list[3]);
+            emit(OP_SET_GLOBAL);
+            emit(global->getGlobalIndex(name));
+            return;
+        }
+
+        auto isBoxed = boxedDeclarations.count(&exp) != 0;
+        emitBoolean(false);
+        if (isBoxed) {
+            emit(OP_BOX);
+        }
+        auto slot = declareLocal(name, false, false, isBoxed);
+
+        genFunction(name, exp.list[2], exp.list[3]);
+        emit(isBoxed ? OP_SET_BOXED : OP_SET_LOCAL);
+        emit(slot);
+        emit(OP_POP);
+    }
+
+    /**
+     * Compiles a function into its own code object (a constant),
+     * and creates a closure of it:
+     *
+     *   CLOSURE <code> <count> (<isLocal> <index>){count}
+     *
+     * The body reads the parameters as its first locals, and the
+     * variables of the enclosing functions as upvalues (see
+     * resolveUpvalue). Boxed parameters are boxed on entry.
+     */
+    void genFunction(const std::string& name, const Exp& params, const Exp& body) {
+        if (params.type != ExpType::LIST || params.list.size() > 255) {
+            DIE << "[EvaCompiler]: invalid parameters of " << name;
+        }
+
+        auto function = AS_CODE(ALLOC_CODE(name));
+        function->isFunction = true;
+        function->arity = params.list.size();
+        compiledFunctions.push_back(function);
+
+        // The function starts with an empty stack, and outside the loops.
+        auto outer = co;
+        auto outerTemporaries = temporaries;
+        std::map<const Exp*, size_t> outerLoopLocals;
+        std::map<std::string, std::vector<std::pair<size_t, int64_t>>> outerInductionUpdates;
+        std::vector<std::set<std::string>> outerLoopAssignments;
+        outerLoopLocals.swap(loopLocals);
+        outerInductionUpdates.swap(inductionUpdates);
+        outerLoopAssignments.swap(loopAssignments);
+
+        co = function;
+        functions.push_back(function);
+        temporaries = 0;
+
+        scopeEnter();
+        for (auto& param : params.list) {
+            if (param.type != ExpType::SYMBOL) {
+                DIE << "[EvaCompiler]: invalid parameter of " << name;
+            }
+            auto isBoxed = boxedDeclarations.count(&param) != 0;
+            auto slot = declareLocal(param.string, false, false, isBoxed);
+            if (isBoxed) {
+                emit(OP_GET_LOCAL);
+                emit(slot);
+                emit(OP_BOX);
+                emit(OP_SET_LOCAL);
+                emit(slot);
+                emit(OP_POP);
+            }
+        }
+
+        gen(body);
+        emit(OP_RETURN);
+
+        finishCode(function);
+
+        co = outer;
+        functions.pop_back();
+        temporaries = outerTemporaries;
+        loopLocals.swap(outerLoopLocals);
+        inductionUpdates.swap(outerInductionUpdates);
+        loopAssignments.swap(outerLoopAssignments);
+
+        auto constIndex = co->constants.size();
+        if (constIndex > 255) {
+            DIE << "[EvaCompiler]: too many constants in " << co->name;
+        }
+        co->constants.push_back((EvaValue){EvaValueType::OBJECT, .object = function});
+
+        emit(OP_CLOSURE);
+        emit(constIndex);
+        emit(function->upvalues.size());
+        for (auto& upvalue : function->upvalues) {
+            emit(upvalue.isLocal);
+            emit(upvalue.index);
+        }
+    }
+
+    /**
+     * Index of the upvalue of a function being compiled (`level` in
+     * `functions`) for the variable, -1 if it's not a local of an
+     * enclosing function. The variable is added to the upvalues of
+     * each function from the one declaring it, inwards: a closure
+     * copies it from its creator, which has it as a local or an upvalue.
+     */
+    int resolveUpvalue(size_t level, const std::string& name) {
+        if (level == 0) {
+            return -1;
+        }
+        auto function = functions[level];
+        for (size_t i = 0; i < function->upvalues.size(); i++) {
+            if (function->upvalues[i].name == name) {
+                return (int)i;
+            }
+        }
+
+        auto enclosing = functions[level - 1];
+        auto localIndex = enclosing->getLocalIndex(name);
+        if (localIndex != -1) {
+            auto& local = enclosing->locals[localIndex];
+            return addUpvalue(function, {name, true, (uint8_t)local.slot, local.isBoxed});
+        }
+
+        auto upvalueIndex = resolveUpvalue(level - 1, name);
+        if (upvalueIndex == -1) {
+            return -1;
+        }
+        return addUpvalue(function, {name, false, (uint8_t)upvalueIndex, enclosing->upvalues[upvalueIndex].isBoxed});
+    }
+
+    int addUpvalue(CodeObject* function, const Upvalue& upvalue) {
+        if (function->upvalues.size() == 255) {
+            DIE << "[EvaCompiler]: too many captured variables in " << function->name;
+        }
+        function->upvalues.push_back(upvalue);
+        return (int)function->upvalues.size() - 1;
+    }
+
+    /**
+     * Whether the name is a local of a function being compiled
+     * (possibly captured), rather than a global.
+     */
+    bool isLocalName(const std::string& name) {
+        return std::any_of(functions.begin(), functions.end(),
+                           [&](CodeObject* function) { return function->getLocalIndex(name) != -1; });
+    }
+
+    /**
+     * Verifies the compiled code, optimizes it, and computes its stack depth.
+     */
+    void finishCode(CodeObject* code) {
+        // Rejects invalid code (a compiler bug) before the optimizer,
+        // which relies on the stack depths being consistent.
+        verifier->verify(code);
+
+        if (optimizationsEnabled) {
+            optimizer.optimize(code);
+            // The stack depth of the optimized code.
+            verifier->verify(code);
+        }
+    }
+
+    /**
+     * Compiles a test to control flow: jumps if its truthiness
+     * (see IS_FALSY) is `jumpIf`, and falls through otherwise. The
+     * addresses of the jumps are added to `jmpAddrs` to be patched.
+     *
+     * and/or/not are short-circuited into the jumps themselves,
+     * without pushing their intermediate values. A constant test
+     * is decided here.
+     */
+    void genTest(const Exp& exp, bool jumpIf, std::vector<size_t>& jmpAddrs) {
+        if (isTaggedList(exp, "not")) {
+            if (exp.list.size() != 2) {
+                DIE << "[EvaCompiler]: invalid not, expected (not <test>)";
+            }
+            genTest(exp.list[1], !jumpIf, jmpAddrs);
+            return;
+        }
+
+        if (isTaggedList(exp, "and") || isTaggedList(exp, "or")) {
+            // The value that decides the result: false for `and`, true for `or`.
+            auto shortCircuit = isTaggedList(exp, "or");
+            auto count = exp.list.size() - 1;
+
+            // (and) is true, (or) is false.
+            if (count == 0) {
+                if (jumpIf != shortCircuit) {
+                    emitJump(OP_JMP, jmpAddrs);
+                }
+                return;
+            }
+
+            // Any deciding operand jumps out.
+            if (jumpIf == shortCircuit) {
+                for (size_t i = 1; i <= count; i++) {
+                    genTest(exp.list[i], jumpIf, jmpAddrs);
+                }
+                return;
+            }
+
+            // A deciding operand skips the jump, which is decided by the last one.
+            std::vector<size_t> skipJmpAddrs;
+            for (size_t i = 1; i < count; i++) {
+                genTest(exp.list[i], shortCircuit, skipJmpAddrs);
+            }
+            genTest(exp.list[count], jumpIf, jmpAddrs);
+
+            auto skipAddr = getOffset();
+            for (auto skipJmpAddr : skipJmpAddrs) {
+                patchJumpAddress(skipJmpAddr, skipAddr);
+            }
+            return;
+        }
+
+        EvaValue constant;
+        if (evalConstant(exp, constant)) {
+            if (IS_FALSY(constant) != jumpIf) {
+                emitJump(OP_JMP, jmpAddrs);
+            }
+            return;
+        }
+
+        gen(exp);
+        emitJump(jumpIf ? OP_JMP_IF_TRUE : OP_JMP_IF_FALSE, jmpAddrs);
+    }
+
+    /**
+     * Emits a jump with a 0 address, added to `jmpAddrs` to be patched.
+     */
+    void emitJump(uint8_t opcode, std::vector<size_t>& jmpAddrs) {
+        emit(opcode);
+        emit(0);
+        emit(0);
+        jmpAddrs.push_back(getOffset() - 2);
+    }
+
+    /**
+     * Switch over literal (int or string) keys. The case bodies
+     * follow the switch instruction, each jumping to the end:
+     *
+     *   <key>
+     *   OP_TABLE_SWITCH / OP_LOOKUP_SWITCH <table>
+     *   <body1> OP_JMP end
+     *   ...
+     *   <alternate>
+     * end:
+     *
+     * The value is the one of the taken body, false if none.
+     */
+    void genSwitch(const Exp& exp) {
+        if (exp.list.size() < 2) {
+            DIE << "[EvaCompiler]: switch without a key";
+        }
+
+        std::vector<const Exp*> cases;
+        const Exp* alternate = nullptr;
+        for (size_t i = 2; i < exp.list.size(); i++) {
+            auto& entry = exp.list[i];
+            if (entry.type != ExpType::LIST || entry.list.size() != 2) {
+                DIE << "[EvaCompiler]: invalid switch case, expected (<key> <body>)";
+            }
+            if (entry.list[0].type == ExpType::SYMBOL && entry.list[0].string == "else") {
+                if (i != exp.list.size() - 1) {
+                    DIE << "[EvaCompiler]: switch else must be the last case";
+                }
+                alternate = &entry.list[1];
+            } else if (entry.list[0].type == ExpType::NUMBER || entry.list[0].type == ExpType::STRING) {
+                cases.push_back(&entry);
+            } else {
+                DIE << "[EvaCompiler]: switch case keys must be number or string literals";
+            }
+        }
+
+        if (co->switchTables.size() > 255) {
+            DIE << "[EvaCompiler]: too many switch instructions in " << co->name;
+        }
+
+        // Dense int keys are indexed, others searched.
+        std::set<int64_t> intKeys;
+        std::set<std::string> stringKeys;
+        for (auto entry : cases) {
+            auto& key = entry->list[0];
+            auto isNew = key.type == ExpType::NUMBER ? intKeys.insert(key.number).second
+                                                     : stringKeys.insert(key.string).second;
+            if (!isNew) {
+                DIE << "[EvaCompiler]: duplicate switch case key";
+            }
+        }
+        // The span of the keys as unsigned, it may not fit in an int64.
+        auto isDense = stringKeys.empty() && !intKeys.empty() &&
+                       (uint64_t)*intKeys.rbegin() - (uint64_t)*intKeys.begin() < 2 * intKeys.size();
+
+        gen(exp.list[1]);
+
+        auto tableIndex = co->switchTables.size();
+        co->switchTables.emplace_back();
+
+        emit(isDense ? OP_TABLE_SWITCH : OP_LOOKUP_SWITCH);
+        emit(tableIndex);
+
+        std::vector<uint16_t> caseAddrs;
+        std::vector<size_t> endJmpAddrs;
+        for (auto entry : cases) {
+            caseAddrs.push_back(getOffset());
+            gen(entry->list[1]);
+
+            emit(OP_JMP);
+            emit(0);
+            emit(0);
+            endJmpAddrs.push_back(getOffset() - 2);
+        }
+
+        uint16_t defaultAddr = getOffset();
+        if (alternate != nullptr) {
+            gen(*alternate);
+        } else {
+            emitBoolean(false);
+        }
+
+        auto endAddr = getOffset();
+        for (auto jmpAddr : endJmpAddrs) {
+            patchJumpAddress(jmpAddr, endAddr);
+        }
+
+        // Filled in last: gen() of the bodies may add switch tables.
+        auto& table = co->switchTables[tableIndex];
+        table.defaultTarget = defaultAddr;
+        if (isDense) {
+            table.low = *intKeys.begin();
+            table.targets.assign(*intKeys.rbegin() - table.low + 1, defaultAddr);
+        }
+        for (size_t i = 0; i < cases.size(); i++) {
+            auto& key = cases[i]->list[0];
+            if (isDense) {
+                table.targets[key.number - table.low] = caseAddrs[i];
+            } else if (key.type == ExpType::NUMBER) {
+                table.intCases.push_back({key.number, caseAddrs[i]});
+            } else {
+                table.stringCases.push_back({key.string, caseAddrs[i]});
+            }
+        }
+        std::sort(table.intCases.begin(), table.intCases.end());
+        std::sort(table.stringCases.begin(), table.stringCases.end());
+    }
+
+    /**
+     * Counted loop: runs <body> with <var> from <start> while it's
+     * less than <end>, adding <step> after each iteration. <end> and
+     * <step> are evaluated once. The loop is tested at the bottom by
+     * a single instruction:
+     *
+     *   <start> <end> <step>                (locals: var, end, step)
+     *   GET_LOCAL var, GET_LOCAL end, COMPARE <, JMP_IF_FALSE exit
+     * loop:
+     *   <body> POP
+     *   LOOP_INC_LT var loop
+     * exit:
+     *   false
+     */
+    void genFor(const Exp& exp) {
+        if (exp.list.size() != 6 || exp.list[1].type != ExpType::SYMBOL) {
+            DIE << "[EvaCompiler]: invalid for, expected (for <var> <start> <end> <step> <body>)";
+        }
+        auto& varName = exp.list[1].string;
+        auto& start = exp.list[2];
+        auto& end = exp.list[3];
+        auto& step = exp.list[4];
+
+        scopeEnter();
+
+        // The values stay on the stack as the locals (declared
+        // after, so that the expressions don't see them).
+        auto isNumber = isNumberExp(start) && isNumberExp(step);
+        auto isNumberEnd = isNumberExp(end);
+        auto isInt = isIntExp(start) && isIntExp(step);
+        gen(start);
+        temporaries++;
+        gen(end);
+        temporaries++;
+        gen(step);
+        temporaries -= 2;
+
+        // The counter is updated in its slot by LOOP_INC_LT.
+        if (boxedDeclarations.count(&exp) != 0) {
+            DIE << "[EvaCompiler]: for counter " << varName << " is assigned after it's captured";
+        }
+        auto varIndex = declareLocal(varName, isNumber, isInt);
+        declareLocal("(end)", isNumberEnd);
+        declareLocal("(step)", isNumber);
+
+        emit(OP_GET_LOCAL);
+        emit(varIndex);
+        emit(OP_GET_LOCAL);
+        emit(varIndex + 1);
+        emit(isNumber && isNumberEnd ? OP_COMPARE_NUM : OP_COMPARE);
+        emit(compareOps_["<"]);
+
+        emit(OP_JMP_IF_FALSE);
+        emit(0);
+        emit(0);
+        auto loopEndJmpAddr = getOffset() - 2;
+
+        auto loopStartAddr = getOffset();
+
+        // Emit <body>, its value is not used.
+        // The counter stays a number (see LOOP_INC_LT).
+        loopAssignments.push_back(findAssignments(exp.list[5]));
+        gen(exp.list[5]);
+        loopAssignments.pop_back();
+        emit(OP_POP);
+
+        emit(OP_LOOP_INC_LT);
+        emit(varIndex);
+        emit(0);
+        emit(0);
+        patchJumpAddress(getOffset() - 2, loopStartAddr);
+
+        patchJumpAddress(loopEndJmpAddr, getOffset());
+
+        emitBoolean(false);
+
+        scopeExit();
+    }
+
+    /**
+     * (while <test> <body>)
+     *
+     * loop:
+     *   <test> JMP_IF_FALSE exit
+     *   <body> POP
+     *   JMP loop
+     * exit:
+     *   false
+     *
+     * Number math on variables that the loop doesn't assign is computed
+     * once, into hidden locals before the loop (loop-invariant code
+     * motion). So are the products of an int induction variable by an
+     * int constant, which are then updated by additions along with the
+     * variable (strength reduction).
+     */
+    void genWhile(const Exp& exp) {
+        if (exp.list.size() != 3) {
+            DIE << "[EvaCompiler]: invalid while, expected (while <test> <body>)";
+        }
+
+        // The hidden locals are in a scope around the loop, which
+        // must not take a declaration that is the body, or the
+        // globals declared in a top-level loop.
+        auto isOptimized = optimizationsEnabled && !isDeclaration(exp.list[2]) &&
+                           !(isGlobalScope() && hasDeclarations(exp));
+
+        loopAssignments.push_back(findAssignments(exp));
+
+        std::vector<const Exp*> loopExps;
+        std::vector<std::string> inductionVars;
+        if (isOptimized) {
+            scopeEnter();
+            hoistInvariants(exp, loopExps);
+            reduceStrength(exp, loopExps, inductionVars);
+        }
+
+        auto loopStartAddr = getOffset();
+
+        // Emit <test>, jumping to the loop end.
+        // Init with 0 addresses, will be patched.
+        std::vector<size_t> loopEndJmpAddrs;
+        genTest(exp.list[1], false, loopEndJmpAddrs);
+
+        // Emit <body>, its value is not used.
+        gen(exp.list[2]);
+        emit(OP_POP);
+
+        // Goto loop start:
+        emit(OP_JMP);
+
+        emit(0);
+        emit(0);
+
+        patchJumpAddress(getOffset() - 2, loopStartAddr);
+
+        // Patch the end.
+        auto loopEndAddr = getOffset();
+        for (auto loopEndJmpAddr : loopEndJmpAddrs) {
+            patchJumpAddress(loopEndJmpAddr, loopEndAddr);
+        }
+
+        // The loop evaluates to the last value of
+        // its <test>, which is always false.
+        emitBoolean(false);
+
+        for (auto loopExp : loopExps) {
+            loopLocals.erase(loopExp);
+        }
+        for (auto& var : inductionVars) {
+            inductionUpdates.erase(var);
+        }
+        loopAssignments.pop_back();
+
+        if (isOptimized) {
+            scopeExit();
+        }
     }
 
     void disassembleBytecode() {
         disassembler->disassemble(co);
     }
 
+    /**
+     * Whether loops are optimized, and the bytecode (see EvaOptimizer).
+     */
+    bool optimizationsEnabled = true;
+
+    /**
+     * Returns the optimizer counters.
+     */
+    const OptimizerStats& getOptimizerStats() const { return optimizer.getStats(); }
+
+    /**
+     * Returns the code objects of all the functions compiled so far.
+     */
+    const std::vector<CodeObject*>& getCompiledFunctions() const { return compiledFunctions; }
+
 private:
     /**
      * Global object.
@@ -335,6 +1115,61 @@ private:
      */
     std::unique_ptr<EvaDisassembler> disassembler;
 
+    /**
+     * Bytecode verifier.
+     */
+    std::unique_ptr<EvaVerifier> verifier;
+
+    /**
+     * Bytecode optimizer.
+     */
+    EvaOptimizer optimizer;
+
+    /**
+     * Finds the variables shared with closures.
+     */
+    EvaCaptureAnalysis captureAnalysis;
+
+    /**
+     * Declarations of the variables to box (see EvaCaptureAnalysis).
+     */
+    std::set<const Exp*> boxedDeclarations;
+
+    /**
+     * Functions being compiled, from the top-level code
+     * to the current one.
+     */
+    std::vector<CodeObject*> functions;
+
+    /**
+     * Every function compiled so far (they are never destroyed).
+     */
+    std::vector<CodeObject*> compiledFunctions;
+
+    /**
+     * Values of the expression being computed on the stack over
+     * the locals (e.g. the computed operands of an operation):
+     * a local declared meanwhile takes the slot above them.
+     */
+    size_t temporaries = 0;
+
+    /**
+     * Loop expressions computed before the loop: the hidden
+     * local of each (by the address of the expression).
+     */
+    std::map<const Exp*, size_t> loopLocals;
+
+    /**
+     * Strength-reduced products of each induction variable:
+     * their hidden locals and the constant factors.
+     */
+    std::map<std::string, std::vector<std::pair<size_t, int64_t>>> inductionUpdates;
+
+    /**
+     * Variables assigned in each enclosing loop.
+     */
+    std::vector<std::set<std::string>> loopAssignments;
+
     /**
      * Enter a new scope.
      */
@@ -357,26 +1192,555 @@ private:
         co->scopeLevel--;
     }
 
+    /**
+     * Declares a local in the next stack slot (over the locals
+     * and the temporaries), returns the slot. Boxed locals are
+     * of unknown type.
+     */
+    size_t declareLocal(const std::string& name, bool isNumber = false, bool isInt = false,
+                        bool isBoxed = false) {
+        auto slot = co->locals.size() + temporaries;
+        if (slot > 255) {
+            DIE << "[EvaCompiler]: too many locals in " << co->name;
+        }
+        co->addLocal(name, slot, isNumber && !isBoxed, isInt && !isBoxed, isBoxed);
+        return slot;
+    }
+
     /**
      * Whether it's the global scope.
      */
-    bool isGlobalScope() { return co->name == "main" && co->scopeLevel == 1; }
+    bool isGlobalScope() { return functions.size() == 1 && co->scopeLevel == 1; }
 
     /**
      * Whether the expression is a declaration.
      */
-    bool isDeclaration(const Exp& exp) { return isVarDeclaration(exp); }
+    bool isDeclaration(const Exp& exp) { return isVarDeclaration(exp) || isTaggedList(exp, "def"); }
 
     /**
      * (var <name> <value>)
      */
     bool isVarDeclaration(const Exp& exp) { return isTaggedList(exp, "var"); }
 
+    /**
+     * (lambda ...) or (def ...): the body is another code object.
+     */
+    bool isFunction(const Exp& exp) { return isTaggedList(exp, "lambda") || isTaggedList(exp, "def"); }
+
     /**
      * Tagged lists.
      */
     bool isTaggedList(const Exp& exp, const std::string& tag) {
-        return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+        return exp.type == ExpType::LIST && !exp.list.empty() && exp.list[0].type == ExpType::SYMBOL &&
+               exp.list[0].string == tag;
+    }
+
+    /**
+     * Whether the expression is known to produce a number:
+     * numeric literals, locals initialized to numbers, and
+     * arithmetic over them.
+     */
+    bool isNumberExp(const Exp& exp) {
+        switch (exp.type) {
+            case ExpType::NUMBER:
+                return true;
+            case ExpType::SYMBOL: {
+                auto localIndex = co->getLocalIndex(exp.string);
+                if (localIndex != -1) {
+                    return co->locals[localIndex].isNumber;
+                }
+                EvaValue constant;
+                return evalConstant(exp, constant) && IS_NUMERIC(constant);
+            }
+            case ExpType::LIST: {
+                if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL) {
+                    return false;
+                }
+                auto& op = exp.list[0].string;
+
+                // Generic math either produces a number, or fails.
+                if (op == "-" || op == "*" || op == "/") {
+                    return true;
+                }
+                if (op == "+") {
+                    return exp.list.size() == 3 && isNumberOperands(exp);
+                }
+                if (op == "set") {
+                    return isNumberExp(exp.list[2]);
+                }
+                return false;
+            }
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Whether the expression is known to produce an int, as long as
+     * its math doesn't overflow: int literals and constants, int
+     * locals, and addition, subtraction and multiplication of them.
+     */
+    bool isIntExp(const Exp& exp) {
+        switch (exp.type) {
+            case ExpType::NUMBER:
+                return true;
+            case ExpType::SYMBOL: {
+                auto localIndex = co->getLocalIndex(exp.string);
+                if (localIndex != -1) {
+                    return co->locals[localIndex].isInt;
+                }
+                EvaValue constant;
+                return evalConstant(exp, constant) && IS_INT(constant);
+            }
+            case ExpType::LIST: {
+                if (exp.list.size() != 3 || exp.list[0].type != ExpType::SYMBOL) {
+                    return false;
+                }
+                auto& op = exp.list[0].string;
+                if (op == "+" || op == "-" || op == "*") {
+                    return isIntExp(exp.list[1]) && isIntExp(exp.list[2]);
+                }
+                if (op == "set") {
+                    return isIntExp(exp.list[2]);
+                }
+                return false;
+            }
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Variables assigned or declared in the expression.
+     */
+    std::set<std::string> findAssignments(const Exp& exp) {
+        std::set<std::string> names;
+        findAssignments(exp, names);
+        return names;
+    }
+
+    void findAssignments(const Exp& exp, std::set<std::string>& names) {
+        if (exp.type != ExpType::LIST) {
+            return;
+        }
+        auto isAssignment = isTaggedList(exp, "set") || isDeclaration(exp) || isTaggedList(exp, "for");
+        if (isAssignment && exp.list.size() > 1 && exp.list[1].type == ExpType::SYMBOL) {
+            names.insert(exp.list[1].string);
+        }
+        for (auto& item : exp.list) {
+            findAssignments(item, names);
+        }
+    }
+
+    /**
+     * Whether the expression declares variables.
+     */
+    bool hasDeclarations(const Exp& exp) {
+        if (exp.type != ExpType::LIST) {
+            return false;
+        }
+        if (isDeclaration(exp) || isTaggedList(exp, "for")) {
+            return true;
+        }
+        for (auto& item : exp.list) {
+            if (hasDeclarations(item)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Whether the variable is assigned in the enclosing loops
+     * (starting from the `skip`-th innermost one).
+     */
+    bool isLoopAssigned(const std::string& name, size_t skip = 0) {
+        return std::any_of(loopAssignments.rbegin() + skip, loopAssignments.rend(),
+                           [&](auto& names) { return names.count(name) != 0; });
+    }
+
+    /**
+     * Whether the expression is a number the current loop doesn't
+     * change, computed without side effects (or failures).
+     *
+     * Locals must not be assigned in any enclosing loop: an assignment
+     * later in an outer loop may make them something else than what
+     * their flags say.
+     */
+    bool isInvariantNumber(const Exp& exp) {
+        if (loopLocals.count(&exp) != 0) {
+            return isMathExp(exp);
+        }
+        switch (exp.type) {
+            case ExpType::NUMBER:
+                return true;
+            case ExpType::SYMBOL: {
+                auto localIndex = co->getLocalIndex(exp.string);
+                if (localIndex != -1) {
+                    return co->locals[localIndex].isNumber && !isLoopAssigned(exp.string);
+                }
+                EvaValue constant;
+                return evalConstant(exp, constant) && IS_NUMERIC(constant);
+            }
+            case ExpType::LIST:
+                return isMathExp(exp) && isInvariantNumber(exp.list[1]) && isInvariantNumber(exp.list[2]);
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Source form of the expression (the same for equal expressions).
+     */
+    static std::string expToString(const Exp& exp) {
+        switch (exp.type) {
+            case ExpType::NUMBER:
+                return std::to_string(exp.number);
+            case ExpType::STRING:
+                return '"' + exp.string + '"';
+            case ExpType::SYMBOL:
+                return exp.string;
+            default: {
+                std::string result = "(";
+                for (auto& item : exp.list) {
+                    result += (result.size() > 1 ? " " : "") + expToString(item);
+                }
+                return result + ")";
+            }
+        }
+    }
+
+    /**
+     * (+|-|*|/ <op1> <op2>)
+     */
+    static bool isMathExp(const Exp& exp) {
+        if (exp.list.size() != 3 || exp.list[0].type != ExpType::SYMBOL) {
+            return false;
+        }
+        auto& op = exp.list[0].string;
+        return op == "+" || op == "-" || op == "*" || op == "/";
+    }
+
+    /**
+     * Math and comparisons in the loop over invariant numbers, the
+     * outermost ones (constant ones are folded instead).
+     */
+    void findInvariants(const Exp& exp, std::vector<const Exp*>& invariants) {
+        if (exp.type != ExpType::LIST || exp.list.empty() || loopLocals.count(&exp) != 0 || isFunction(exp)) {
+            return;
+        }
+        auto isCandidate = exp.list.size() == 3 && exp.list[0].type == ExpType::SYMBOL &&
+                           (isMathExp(exp) || compareOps_.count(exp.list[0].string) != 0) &&
+                           isInvariantNumber(exp.list[1]) && isInvariantNumber(exp.list[2]);
+        EvaValue constant;
+        if (isCandidate && !evalConstant(exp, constant)) {
+            invariants.push_back(&exp);
+            return;
+        }
+        // The operator and the names are not computed.
+        size_t first = isTaggedList(exp, "set") || isTaggedList(exp, "var") ? 2 : 1;
+        for (auto i = first; i < exp.list.size(); i++) {
+            findInvariants(exp.list[i], invariants);
+        }
+    }
+
+    /**
+     * Loop-invariant code motion: the invariants of the loop are
+     * computed into hidden locals before it, the same expressions
+     * into the same local.
+     */
+    void hoistInvariants(const Exp& exp, std::vector<const Exp*>& loopExps) {
+        std::vector<const Exp*> invariants;
+        findInvariants(exp.list[1], invariants);
+        findInvariants(exp.list[2], invariants);
+
+        std::map<std::string, size_t> localIndices;
+        for (auto invariant : invariants) {
+            auto key = expToString(*invariant);
+            if (localIndices.count(key) == 0) {
+                gen(*invariant);
+                localIndices[key] =
+                        declareLocal("(invariant " + key + ")", isMathExp(*invariant), isIntExp(*invariant));
+            }
+            loopLocals[invariant] = localIndices[key];
+            loopExps.push_back(invariant);
+        }
+    }
+
+    /**
+     * Strength reduction: the products of an int induction variable
+     * (only incremented by int constants in the loop) by an int
+     * constant are computed into hidden locals before the loop, and
+     * updated along with the variable, by additions.
+     *
+     * An update is 5 instructions, a product 3 (the VM multiplies as
+     * fast as it adds), so the products are reduced only if they are
+     * used more than the variable is updated.
+     */
+    void reduceStrength(const Exp& exp, std::vector<const Exp*>& loopExps,
+                        std::vector<std::string>& inductionVars) {
+        std::map<std::string, std::vector<const Exp*>> updates;
+        std::map<std::string, std::map<int64_t, std::vector<const Exp*>>> products;
+        std::set<std::string> declarations;
+        findInductions(exp, updates, products, declarations);
+
+        for (auto& entry : products) {
+            auto& varName = entry.first;
+            auto localIndex = co->getLocalIndex(varName);
+            auto isInduction = localIndex != -1 && co->locals[localIndex].isInt &&
+                               declarations.count(varName) == 0 && !updates[varName].empty() &&
+                               !isLoopAssigned(varName, 1);
+            if (!isInduction) {
+                continue;
+            }
+            for (auto& product : entry.second) {
+                auto factor = product.first;
+                auto& uses = product.second;
+                if (2 * uses.size() <= 5 * updates[varName].size()) {
+                    continue;
+                }
+
+                gen(*uses[0]);
+                auto localIndex = declareLocal("(reduced " + expToString(*uses[0]) + ")", true, true);
+
+                for (auto use : uses) {
+                    loopLocals[use] = localIndex;
+                    loopExps.push_back(use);
+                }
+                if (inductionUpdates.count(varName) == 0) {
+                    inductionVars.push_back(varName);
+                }
+                inductionUpdates[varName].push_back({localIndex, factor});
+            }
+        }
+    }
+
+    /**
+     * Collects the updates of the variables in the loop that are
+     * increments by an int constant, the products of variables by an
+     * int constant, and the variables declared in the loop. Another
+     * assignment of a variable leaves it without updates.
+     */
+    void findInductions(const Exp& exp, std::map<std::string, std::vector<const Exp*>>& updates,
+                        std::map<std::string, std::map<int64_t, std::vector<const Exp*>>>& products,
+                        std::set<std::string>& declarations) {
+        if (exp.type != ExpType::LIST || isFunction(exp)) {
+            return;
+        }
+        if ((isVarDeclaration(exp) || isTaggedList(exp, "for")) && exp.list.size() > 1) {
+            declarations.insert(exp.list[1].string);
+        }
+        if (isTaggedList(exp, "set") && exp.list.size() == 3 && exp.list[1].type == ExpType::SYMBOL) {
+            int64_t step;
+            if (readIncrement(exp.list[1].string, exp.list[2], step)) {
+                updates[exp.list[1].string].push_back(&exp);
+            } else {
+                declarations.insert(exp.list[1].string);
+            }
+        }
+
+        std::string varName;
+        int64_t factor;
+        if (readProduct(exp, varName, factor)) {
+            products[varName][factor].push_back(&exp);
+        }
+
+        for (auto& item : exp.list) {
+            findInductions(item, updates, products, declarations);
+        }
+    }
+
+    /**
+     * (+ <var> <int>), (+ <int> <var>) or (- <var> <int>):
+     * reads the increment.
+     */
+    bool readIncrement(const std::string& varName, const Exp& exp, int64_t& step) {
+        if (!isMathExp(exp)) {
+            return false;
+        }
+        auto& op = exp.list[0].string;
+        auto isVar = [&](const Exp& operand) {
+            return operand.type == ExpType::SYMBOL && operand.string == varName;
+        };
+
+        EvaValue constant;
+        if (op == "+" && isVar(exp.list[1]) && evalConstant(exp.list[2], constant) && IS_INT(constant)) {
+            step = AS_INT(constant);
+            return true;
+        }
+        if (op == "+" && isVar(exp.list[2]) && evalConstant(exp.list[1], constant) && IS_INT(constant)) {
+            step = AS_INT(constant);
+            return true;
+        }
+        if (op == "-" && isVar(exp.list[1]) && evalConstant(exp.list[2], constant) && IS_INT(constant)) {
+            return !__builtin_sub_overflow((int64_t)0, AS_INT(constant), &step);
+        }
+        return false;
+    }
+
+    /**
+     * (* <local> <int>) or (* <int> <local>): reads the local and the factor.
+     */
+    bool readProduct(const Exp& exp, std::string& varName, int64_t& factor) {
+        if (!isTaggedList(exp, "*") || exp.list.size() != 3) {
+            return false;
+        }
+        for (auto i : {1, 2}) {
+            auto& var = exp.list[i];
+            EvaValue constant;
+            if (var.type == ExpType::SYMBOL && co->getLocalIndex(var.string) != -1 &&
+                evalConstant(exp.list[3 - i], constant) && IS_INT(constant)) {
+                varName = var.string;
+                factor = AS_INT(constant);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * After an induction variable is set (to <value>), adds the increment
+     * times the factor to its reduced products (see reduceStrength).
+     */
+    void emitInductionUpdates(const std::string& varName, const Exp& value) {
+        auto reduced = inductionUpdates.find(varName);
+        if (reduced == inductionUpdates.end()) {
+            return;
+        }
+        int64_t step;
+        if (!readIncrement(varName, value, step)) {
+            DIE << "[EvaCompiler]: invalid update of induction variable " << varName;
+        }
+        for (auto& product : reduced->second) {
+            int64_t increment;
+            auto fits = !__builtin_mul_overflow(step, product.second, &increment);
+
+            emit(OP_GET_LOCAL);
+            emit(product.first);
+            if (fits) {
+                emitInt(increment);
+            } else {
+                emitValue(NUMBER((double)step * (double)product.second));
+            }
+            emit(OP_ADD_NUM);
+            emit(OP_SET_LOCAL);
+            emit(product.first);
+            emit(OP_POP);
+        }
+    }
+
+    /**
+     * Computes a constant expression: literals, global constants,
+     * and math and comparisons over numbers (with the semantics of
+     * the VM). Returns false if the expression is not constant.
+     */
+    bool evalConstant(const Exp& exp, EvaValue& result) {
+        switch (exp.type) {
+            case ExpType::NUMBER: {
+                result = INT(exp.number);
+                return true;
+            }
+            case ExpType::SYMBOL: {
+                if (exp.string == "true" || exp.string == "false") {
+                    result = BOOLEAN(exp.string == "true");
+                    return true;
+                }
+                if (isLocalName(exp.string)) {
+                    return false;
+                }
+                auto globalIndex = global->getGlobalIndex(exp.string);
+                if (globalIndex == -1 || !global->get(globalIndex).isConst) {
+                    return false;
+                }
+                result = global->get(globalIndex).value;
+                return true;
+            }
+            case ExpType::LIST: {
+                if (exp.list.size() != 3 || exp.list[0].type != ExpType::SYMBOL) {
+                    return false;
+                }
+                auto& op = exp.list[0].string;
+                auto isMath = op == "+" || op == "-" || op == "*" || op == "/";
+                if (!isMath && compareOps_.count(op) == 0) {
+                    return false;
+                }
+
+                EvaValue op1, op2;
+                if (!evalConstant(exp.list[1], op1) || !IS_NUMERIC(op1) ||
+                    !evalConstant(exp.list[2], op2) || !IS_NUMERIC(op2)) {
+                    return false;
+                }
+
+                result = isMath ? foldMath(op[0], op1, op2) : foldCompare(compareOps_[op], op1, op2);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Number math: in integers if both are ints, and the result
+     * fits, in doubles otherwise. Division produces a double.
+     */
+    static EvaValue foldMath(char op, const EvaValue& op1, const EvaValue& op2) {
+        int64_t intResult;
+        if (IS_INT(op1) && IS_INT(op2)) {
+            auto a = AS_INT(op1);
+            auto b = AS_INT(op2);
+            if ((op == '+' && !__builtin_add_overflow(a, b, &intResult)) ||
+                (op == '-' && !__builtin_sub_overflow(a, b, &intResult)) ||
+                (op == '*' && !__builtin_mul_overflow(a, b, &intResult))) {
+                return INT(intResult);
+            }
+        }
+        auto a = AS_DOUBLE(op1);
+        auto b = AS_DOUBLE(op2);
+        switch (op) {
+            case '+': return NUMBER(a + b);
+            case '-': return NUMBER(a - b);
+            case '*': return NUMBER(a * b);
+            default: return NUMBER(a / b);
+        }
+    }
+
+    /**
+     * Number comparison, see compareOps_.
+     */
+    static EvaValue foldCompare(uint8_t op, const EvaValue& op1, const EvaValue& op2) {
+        if (IS_INT(op1) && IS_INT(op2)) {
+            return BOOLEAN(compare(op, AS_INT(op1), AS_INT(op2)));
+        }
+        return BOOLEAN(compare(op, AS_DOUBLE(op1), AS_DOUBLE(op2)));
+    }
+
+    template <typename T>
+    static bool compare(uint8_t op, T a, T b) {
+        switch (op) {
+            case 0: return a < b;
+            case 1: return a > b;
+            case 2: return a == b;
+            case 3: return a >= b;
+            case 4: return a <= b;
+            default: return a != b;
+        }
+    }
+
+    /**
+     * Global constants can't be assigned.
+     */
+    void checkNotConst(const std::string& name) {
+        auto globalIndex = global->getGlobalIndex(name);
+        if (globalIndex != -1 && global->get(globalIndex).isConst) {
+            DIE << "[EvaCompiler]: Assignment to constant " << name;
+        }
+    }
+
+    /**
+     * Whether both operands of a binary operation are numbers.
+     */
+    bool isNumberOperands(const Exp& exp) {
+        return isNumberExp(exp.list[1]) && isNumberExp(exp.list[2]);
     }
 
     /**
@@ -385,11 +1749,9 @@ private:
     size_t getVarsCountOnScopeExit() {
         auto varsCount = 0;
 
-        if ( co->locals.size() > 0 ) {
-            while (co->locals.back().scopeLevel == co->scopeLevel) {
-                co->locals.pop_back();
-                varsCount++;
-            }
+        while (co->locals.size() > 0 && co->locals.back().scopeLevel == co->scopeLevel) {
+            co->locals.pop_back();
+            varsCount++;
         }
 
         return varsCount;
@@ -409,6 +1771,14 @@ private:
         return co->constants.size() - 1;
     }
 
+    /**
+     * Allocates an integer constant.
+     */
+    size_t intConstIdx(int64_t value) {
+        ALLOC_CONST(IS_INT, AS_INT, INT, value);
+        return co->constants.size() - 1;
+    }
+
     /**
      * Allocates a boolean constant.
      */
@@ -425,10 +1795,60 @@ private:
         return co->constants.size() - 1;
     }
 
+    /**
+     * Pushes an int: small ones are immediate operands,
+     * others are in the constant pool.
+     */
+    void emitInt(int64_t value) {
+        if (value >= INT8_MIN && value <= INT8_MAX) {
+            emit(OP_PUSH_SMALLINT8);
+            emit((uint8_t)(int8_t)value);
+        } else if (value >= INT16_MIN && value <= INT16_MAX) {
+            emit(OP_PUSH_SMALLINT16);
+            emit(((uint16_t)(int16_t)value >> 8) & 0xff);
+            emit((uint16_t)(int16_t)value & 0xff);
+        } else {
+            emit(OP_CONST);
+            emit(intConstIdx(value));
+        }
+    }
+
+    /**
+     * Pushes a boolean.
+     */
+    void emitBoolean(bool value) { emit(value ? OP_PUSH_TRUE : OP_PUSH_FALSE); }
+
+    /**
+     * Pushes a constant number or boolean.
+     */
+    void emitValue(const EvaValue& value) {
+        if (IS_INT(value)) {
+            emitInt(AS_INT(value));
+        } else if (IS_BOOLEAN(value)) {
+            emitBoolean(AS_BOOLEAN(value));
+        } else if (IS_NUMBER(value)) {
+            emit(OP_CONST);
+            emit(numericConstIdx(AS_NUMBER(value)));
+        } else {
+            DIE << "[EvaCompiler]: unsupported constant: " << value;
+        }
+    }
+
     /**
      * Emits data to the bytecode.
      */
-    void emit(uint8_t code) { co->code.push_back(code); }
+    void emit(uint8_t code) {
+        auto& lines = co->lineTable;
+        if (lines.empty() || lines.back().line != currentLine) {
+            auto offset = (uint32_t)getOffset();
+            if (!lines.empty() && lines.back().offset == offset) {
+                lines.back().line = currentLine;
+            } else {
+                lines.push_back({offset, currentLine});
+            }
+        }
+        co->code.push_back(code);
+    }
 
     /**
      * Writes byte at offset.
@@ -450,6 +1870,11 @@ private:
      */
     CodeObject* co;
 
+    /**
+     * Source line of the code being emitted.
+     */
+    uint32_t currentLine = 0;
+
 
 
 
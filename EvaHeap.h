@@ -0,0 +1,582 @@
+//
+// Created by Retros on 2023/4/1.
+//
+
+#ifndef RETROSEVAVM_EVAHEAP_H
+#define RETROSEVAVM_EVAHEAP_H
+
+#include <array>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include "EvaArena.h"
+#include "EvaValue.h"
+#include "Global.h"
+#include "Logger.h"
+
+/**
+ * Garbage collector settings.
+ */
+struct GCConfig {
+    /**
+     * Nursery size: a minor collection runs when it is full.
+     */
+    size_t nurseryBytes = 1024 * 1024;
+
+    /**
+     * Time budget of a single pause (a minor collection is
+     * bounded by the nursery size instead).
+     */
+    std::chrono::nanoseconds pauseBudget = std::chrono::microseconds(500);
+
+    /**
+     * A major collection starts once the old generation grew
+     * by this factor since the last one ...
+     */
+    double majorGrowthFactor = 2.0;
+
+    /**
+     * ... and holds at least this many objects.
+     */
+    size_t minMajorObjects = 4096;
+};
+
+/**
+ * Number of pause histogram buckets: < 10us, < 100us, < 1ms,
+ * < 10ms, and longer.
+ */
+const size_t GC_PAUSE_BUCKETS = 5;
+
+/**
+ * Garbage collector counters.
+ */
+struct GCStats {
+    size_t minorCollections = 0;
+    size_t majorCollections = 0;
+
+    /**
+     * Objects evacuated from the nursery, and freed from
+     * the old generation.
+     */
+    size_t promoted = 0;
+    size_t freed = 0;
+
+    /**
+     * Pauses by duration (see GC_PAUSE_BUCKETS).
+     */
+    std::array<size_t, GC_PAUSE_BUCKETS> pauseHistogram{};
+    std::chrono::nanoseconds maxPause{0};
+};
+
+/**
+ * Roots of the collection: the live part of the
+ * operand stack, and the globals.
+ */
+struct GCRoots {
+    EvaValue* stackBegin;
+    EvaValue** sp;
+    Global* global;
+};
+
+/**
+ * Generational heap.
+ *
+ * Young objects are bump-allocated in the nursery (an arena). When it
+ * fills up, a minor collection evacuates the objects reachable from
+ * the roots to the old generation, and resets the nursery at once.
+ *
+ * The old generation is collected by an incremental mark and sweep:
+ * the work is split into slices run between instructions (step()),
+ * each bounded by the pause budget. Objects allocated while a cycle
+ * is in progress are allocated marked (black), stores into globals
+ * mark the stored object (write barrier), and the stack is rescanned
+ * atomically when marking finishes.
+ *
+ * Compiler-owned objects (constants) are permanent, and not tracked.
+ * Closures are young like strings (their upvalues are copied at
+ * creation, and never change); the mutable boxes of the variables
+ * they share are old.
+ */
+class EvaHeap {
+public:
+    explicit EvaHeap(GCRoots roots, GCConfig config = {})
+        : config(config), roots(roots), nextMajor(config.minMajorObjects) {}
+
+    ~EvaHeap() {
+        for (auto object : oldObjects) {
+            destroy(object);
+        }
+    }
+
+    EvaHeap(const EvaHeap&) = delete;
+    EvaHeap& operator=(const EvaHeap&) = delete;
+
+    // ------------------------------------
+    // Allocation
+
+    /**
+     * Allocates a young string.
+     */
+    EvaValue allocString(std::string&& value) {
+        if (nursery.bytesAllocated() + sizeof(StringObject) > config.nurseryBytes) {
+            collectMinor();
+        }
+
+        auto object = nursery.create<StringObject>(std::move(value));
+        object->generation = Generation::YOUNG;
+
+        // Short strings are stored inline, and need no destructor.
+        auto chars = object->string.data();
+        auto isInline = chars >= (const char*)object && chars < (const char*)(object + 1);
+        if (!isInline) {
+            nursery.finalizeOnReset(object);
+        }
+
+        return (EvaValue){EvaValueType::OBJECT, .object = object};
+    }
+
+    /**
+     * Allocates an array. Arrays are mutable (a young copy could not be
+     * promoted without fixing every reference) and often large, so they
+     * are allocated in the old generation directly.
+     */
+    EvaValue allocArray(std::vector<double>&& values) {
+        auto object = new ArrayObject(std::move(values));
+        allocateOld(object);
+        return (EvaValue){EvaValueType::OBJECT, .object = object};
+    }
+
+    /**
+     * Allocates an empty map. Maps are mutable, and allocated
+     * in the old generation (see allocArray); the entries stored
+     * in them must be promoted.
+     */
+    EvaValue allocMap() {
+        auto object = new MapObject();
+        allocateOld(object);
+        return (EvaValue){EvaValueType::OBJECT, .object = object};
+    }
+
+    /**
+     * Allocates a young closure of the code, with room for its
+     * upvalues (set by the caller). One allocation, however many
+     * variables it captures.
+     *
+     * May run a minor collection: the values to capture must be
+     * read from the roots after it.
+     */
+    ClosureObject* allocClosure(CodeObject* code, size_t upvaluesCount) {
+        auto size = ClosureObject::sizeFor(upvaluesCount);
+        if (nursery.bytesAllocated() + size > config.nurseryBytes) {
+            collectMinor();
+        }
+
+        // Upvalues are plain values: no destructor to run.
+        auto object = new (nursery.allocate(size, alignof(ClosureObject))) ClosureObject(code, upvaluesCount);
+        object->generation = Generation::YOUNG;
+        return object;
+    }
+
+    /**
+     * Allocates a box. Boxes are mutable, and allocated in the
+     * old generation (see allocArray); the value is promoted.
+     */
+    EvaValue allocBox(const EvaValue& value) {
+        auto oldValue = promote(value);
+        writeBarrier(oldValue);
+        auto object = new BoxObject(oldValue);
+        allocateOld(object);
+        return (EvaValue){EvaValueType::OBJECT, .object = object};
+    }
+
+    /**
+     * Moves a young value escaping to a long-lived place
+     * (a global, or the result of the execution) to the old generation.
+     */
+    EvaValue promote(const EvaValue& value) {
+        if (!IS_OBJECT(value) || AS_OBJECT(value)->generation != Generation::YOUNG) {
+            return value;
+        }
+        return (EvaValue){EvaValueType::OBJECT, .object = evacuate(AS_OBJECT(value))};
+    }
+
+    /**
+     * Write barrier of stores into roots that are not rescanned
+     * (globals): keeps the marking invariant during a cycle.
+     */
+    void writeBarrier(const EvaValue& value) {
+        if (state == State::MARKING) {
+            mark(value);
+        }
+    }
+
+    // ------------------------------------
+    // Collection
+
+    /**
+     * Minor collection: evacuates reachable young objects,
+     * and resets the nursery.
+     */
+    void collectMinor() {
+        auto start = Clock::now();
+
+        forEachRoot([this](EvaValue& slot) { slot = promote(slot); });
+
+        forwarded.clear();
+        nursery.reset();
+
+        stats.minorCollections++;
+        recordPause(Clock::now() - start);
+    }
+
+    /**
+     * Ends an execution: everything still young is garbage
+     * (escaping values are promoted on the way out).
+     */
+    void resetNursery() {
+        forwarded.clear();
+        nursery.reset();
+    }
+
+    /**
+     * Runs a slice of the incremental old generation collection,
+     * if one is in progress.
+     */
+    void step() {
+        if (state == State::IDLE) {
+            return;
+        }
+
+        auto start = Clock::now();
+        auto deadline = start + config.pauseBudget;
+
+        size_t work = 0;
+        auto overBudget = [&]() {
+            // Checking the clock is not free.
+            return ++work % 64 == 0 && Clock::now() >= deadline;
+        };
+
+        if (state == State::MARKING) {
+            markSlice(overBudget);
+        }
+        if (state == State::SWEEPING) {
+            sweepSlice(overBudget);
+        }
+
+        recordPause(Clock::now() - start);
+    }
+
+    /**
+     * Whether an incremental cycle is in progress.
+     */
+    bool isCollecting() const { return state != State::IDLE; }
+
+    /**
+     * Runs a complete old generation collection.
+     */
+    void collectMajor() {
+        if (state == State::IDLE) {
+            startMajor();
+        }
+        auto never = []() { return false; };
+        if (state == State::MARKING) {
+            markSlice(never);
+        }
+        sweepSlice(never);
+    }
+
+    /**
+     * Counters.
+     */
+    const GCStats& getStats() const { return stats; }
+
+    /**
+     * Objects in the old generation.
+     */
+    size_t oldObjectsCount() const { return oldObjects.size(); }
+
+    /**
+     * Settings.
+     */
+    GCConfig config;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    enum class State {
+        IDLE,
+        MARKING,
+        SWEEPING,
+    };
+
+    /**
+     * Copies a young object to the old generation, once.
+     */
+    Object* evacuate(Object* object) {
+        auto it = forwarded.find(object);
+        if (it != forwarded.end()) {
+            return it->second;
+        }
+
+        Object* copy = nullptr;
+        switch (object->type) {
+            case ObjectType::STRING: {
+                auto string = (StringObject*)object;
+                auto stringCopy = new StringObject(string->string);
+                stringCopy->hash = string->hash;
+                copy = stringCopy;
+                break;
+            }
+            case ObjectType::CLOSURE: {
+                // The upvalues move along: old objects don't
+                // reference young ones.
+                auto closure = (ClosureObject*)object;
+                auto count = closure->upvaluesCount;
+                auto closureCopy = new (::operator new(ClosureObject::sizeFor(count)))
+                        ClosureObject(closure->code, count);
+                for (size_t i = 0; i < count; i++) {
+                    closureCopy->upvalues()[i] = promote(closure->upvalues()[i]);
+                    writeBarrier(closureCopy->upvalues()[i]);
+                }
+                copy = closureCopy;
+                break;
+            }
+            default:
+                DIE << "EvaHeap: unexpected young object of type " << (int)object->type;
+        }
+
+        forwarded[object] = copy;
+
+        allocateOld(copy);
+        stats.promoted++;
+        return copy;
+    }
+
+    /**
+     * Registers an object in the old generation.
+     */
+    void allocateOld(Object* object) {
+        object->generation = Generation::OLD;
+
+        // Allocated black during marking. During sweeping, objects
+        // past sweepEnd are not visited, and stay unmarked.
+        object->marked = state == State::MARKING;
+
+        oldObjects.push_back(object);
+
+        if (state == State::IDLE && oldObjects.size() >= nextMajor) {
+            startMajor();
+        }
+    }
+
+    /**
+     * Starts an incremental cycle: marks the globals.
+     */
+    void startMajor() {
+        state = State::MARKING;
+        gray.clear();
+        globalsCursor = 0;
+    }
+
+    template <typename OverBudget>
+    void markSlice(OverBudget overBudget) {
+        auto& globals = roots.global->globals;
+
+        while (globalsCursor < globals.size()) {
+            mark(globals[globalsCursor++].value);
+            if (overBudget()) {
+                return;
+            }
+        }
+
+        while (!gray.empty()) {
+            auto object = gray.back();
+            gray.pop_back();
+            traceChildren(object);
+            if (overBudget()) {
+                return;
+            }
+        }
+
+        // Final remark: the stack is not barriered, so it is
+        // scanned atomically (it is bounded by its depth).
+        forEachStackSlot([this](EvaValue& slot) { mark(slot); });
+        while (!gray.empty()) {
+            auto object = gray.back();
+            gray.pop_back();
+            traceChildren(object);
+        }
+
+        state = State::SWEEPING;
+        sweepCursor = 0;
+        sweepKept = 0;
+        sweepEnd = oldObjects.size();
+    }
+
+    template <typename OverBudget>
+    void sweepSlice(OverBudget overBudget) {
+        while (sweepCursor < sweepEnd) {
+            auto object = oldObjects[sweepCursor++];
+            if (object->marked) {
+                object->marked = false;
+                oldObjects[sweepKept++] = object;
+            } else {
+                destroy(object);
+                stats.freed++;
+            }
+            if (overBudget()) {
+                return;
+            }
+        }
+
+        // Objects allocated while sweeping.
+        oldObjects.erase(
+            std::move(oldObjects.begin() + sweepEnd, oldObjects.end(), oldObjects.begin() + sweepKept),
+            oldObjects.end());
+
+        state = State::IDLE;
+        stats.majorCollections++;
+
+        nextMajor = std::max(config.minMajorObjects,
+                             (size_t)((double)oldObjects.size() * config.majorGrowthFactor));
+    }
+
+    /**
+     * Marks an old object reachable (gray).
+     */
+    void mark(const EvaValue& value) {
+        if (!IS_OBJECT(value)) {
+            return;
+        }
+        auto object = AS_OBJECT(value);
+
+        // Young closures are not marked, but the old objects
+        // they capture must be.
+        if (object->generation == Generation::YOUNG && object->type == ObjectType::CLOSURE) {
+            traceChildren(object);
+            return;
+        }
+
+        if (object->generation != Generation::OLD || object->marked) {
+            return;
+        }
+        object->marked = true;
+        gray.push_back(object);
+    }
+
+    /**
+     * Marks the objects referenced by an object (black).
+     */
+    void traceChildren(Object* object) {
+        switch (object->type) {
+            case ObjectType::MAP:
+                ((MapObject*)object)->forEach([this](StringObject* key, const EvaValue& value) {
+                    mark((EvaValue){EvaValueType::OBJECT, .object = key});
+                    mark(value);
+                });
+                break;
+            case ObjectType::CLOSURE: {
+                auto closure = (ClosureObject*)object;
+                for (size_t i = 0; i < closure->upvaluesCount; i++) {
+                    mark(closure->upvalues()[i]);
+                }
+                break;
+            }
+            case ObjectType::BOX:
+                mark(((BoxObject*)object)->value);
+                break;
+            // Strings and arrays (of numbers) reference nothing.
+            default:
+                break;
+        }
+    }
+
+    template <typename Visitor>
+    void forEachStackSlot(Visitor visit) {
+        for (auto slot = roots.stackBegin; slot < *roots.sp; slot++) {
+            visit(*slot);
+        }
+    }
+
+    template <typename Visitor>
+    void forEachRoot(Visitor visit) {
+        forEachStackSlot(visit);
+        for (auto& global : roots.global->globals) {
+            visit(global.value);
+        }
+    }
+
+    void destroy(Object* object) {
+        switch (object->type) {
+            case ObjectType::STRING:
+                delete (StringObject*)object;
+                break;
+            case ObjectType::ARRAY:
+                delete (ArrayObject*)object;
+                break;
+            case ObjectType::MAP:
+                delete (MapObject*)object;
+                break;
+            case ObjectType::CLOSURE: {
+                // Allocated with its upvalues (see evacuate).
+                auto closure = (ClosureObject*)object;
+                closure->~ClosureObject();
+                ::operator delete(closure);
+                break;
+            }
+            case ObjectType::BOX:
+                delete (BoxObject*)object;
+                break;
+            default:
+                DIE << "EvaHeap: cannot destroy object of type " << (int)object->type;
+        }
+    }
+
+    void recordPause(Clock::duration pause) {
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(pause);
+        auto micros = nanos.count() / 1000;
+
+        size_t bucket = 0;
+        for (auto limit = 10; bucket < GC_PAUSE_BUCKETS - 1 && micros >= limit; limit *= 10) {
+            bucket++;
+        }
+        stats.pauseHistogram[bucket]++;
+        stats.maxPause = std::max(stats.maxPause, nanos);
+    }
+
+    /**
+     * Collection roots.
+     */
+    GCRoots roots;
+
+    /**
+     * Young generation.
+     */
+    EvaArena nursery;
+
+    /**
+     * Young objects already copied during the current evacuation.
+     */
+    std::unordered_map<Object*, Object*> forwarded;
+
+    /**
+     * Old generation.
+     */
+    std::vector<Object*> oldObjects;
+    size_t nextMajor;
+
+    /**
+     * Incremental cycle state.
+     */
+    State state = State::IDLE;
+    std::vector<Object*> gray;
+    size_t globalsCursor = 0;
+    size_t sweepCursor = 0;
+    size_t sweepKept = 0;
+    size_t sweepEnd = 0;
+
+    GCStats stats;
+};
+
+#endif //RETROSEVAVM_EVAHEAP_H
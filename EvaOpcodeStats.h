@@ -0,0 +1,173 @@
+//
+// Created by Retros on 2023/4/15.
+//
+
+#ifndef RETROSEVAVM_EVAOPCODESTATS_H
+#define RETROSEVAVM_EVAOPCODESTATS_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+#include "OpCode.h"
+
+/**
+ * Instruction counters are compiled in with EVA_OPCODE_STATS,
+ * cycle accounting with EVA_OPCODE_CYCLES (which implies the former).
+ * Without them the VM has no instrumentation at all.
+ */
+#if defined(EVA_OPCODE_CYCLES) && !defined(EVA_OPCODE_STATS)
+#define EVA_OPCODE_STATS
+#endif
+
+/**
+ * Number of opcode values.
+ */
+const size_t OPCODES_COUNT = 256;
+
+/**
+ * Per-opcode and per-opcode-pair execution counters.
+ *
+ * A pair (a, b) is an execution of b right after a. Cycles are measured
+ * from the start of an instruction to the start of the next one (the
+ * time stamp counter on x86, nanoseconds elsewhere), so they include the
+ * dispatch. Instructions run by the JIT are not counted.
+ */
+struct OpcodeStats {
+    std::array<uint64_t, OPCODES_COUNT> counts{};
+    std::array<uint64_t, OPCODES_COUNT> cycles{};
+
+    /**
+     * Pair counters, indexed by (previous << 8 | current).
+     */
+    std::vector<uint64_t> pairCounts = std::vector<uint64_t>(OPCODES_COUNT * OPCODES_COUNT);
+    std::vector<uint64_t> pairCycles = std::vector<uint64_t>(OPCODES_COUNT * OPCODES_COUNT);
+
+    void reset() {
+        counts.fill(0);
+        cycles.fill(0);
+        std::fill(pairCounts.begin(), pairCounts.end(), 0);
+        std::fill(pairCycles.begin(), pairCycles.end(), 0);
+    }
+};
+
+/**
+ * Records the instructions of the eval loop.
+ */
+class OpcodeCounter {
+public:
+    /**
+     * Starts an eval loop: nothing is executing yet.
+     */
+    void begin() {
+        previous = NONE;
+        current = NONE;
+    }
+
+    /**
+     * An instruction starts.
+     */
+    void record(uint8_t opcode) {
+#ifdef EVA_OPCODE_CYCLES
+        auto now = timestamp();
+        if (current != NONE) {
+            auto elapsed = now - start;
+            stats.cycles[current] += elapsed;
+            if (previous != NONE) {
+                stats.pairCycles[previous << 8 | current] += elapsed;
+            }
+        }
+        start = now;
+#endif
+        stats.counts[opcode]++;
+        if (current != NONE) {
+            stats.pairCounts[current << 8 | opcode]++;
+        }
+        previous = current;
+        current = opcode;
+    }
+
+    OpcodeStats stats;
+
+private:
+    static const unsigned NONE = OPCODES_COUNT;
+
+    static uint64_t timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    unsigned previous = NONE;
+    unsigned current = NONE;
+    uint64_t start = 0;
+};
+
+/**
+ * Prints the opcodes by execution count, and the `topPairs`
+ * most frequent pairs.
+ */
+void writeOpcodeReport(const OpcodeStats& stats, std::ostream& out, size_t topPairs = 10) {
+    uint64_t total = 0;
+    std::vector<size_t> opcodes;
+    for (size_t op = 0; op < OPCODES_COUNT; op++) {
+        if (stats.counts[op] > 0) {
+            total += stats.counts[op];
+            opcodes.push_back(op);
+        }
+    }
+    std::sort(opcodes.begin(), opcodes.end(),
+              [&](size_t a, size_t b) { return stats.counts[a] > stats.counts[b]; });
+
+    auto f = out.flags();
+    out << std::fixed << std::setprecision(1);
+
+    out << "\n---------- Opcodes: " << total << " executed ----------\n";
+    out << std::left << std::setw(16) << "opcode" << std::right << std::setw(14) << "count"
+        << std::setw(8) << "%" << std::setw(16) << "cycles" << std::setw(10) << "cyc/op" << "\n";
+
+    for (auto op : opcodes) {
+        auto count = stats.counts[op];
+        out << std::left << std::setw(16) << opcodeToString(op) << std::right << std::setw(14) << count
+            << std::setw(8) << 100.0 * count / total << std::setw(16) << stats.cycles[op] << std::setw(10)
+            << (double)stats.cycles[op] / count << "\n";
+    }
+
+    std::vector<size_t> pairs;
+    for (size_t pair = 0; pair < stats.pairCounts.size(); pair++) {
+        if (stats.pairCounts[pair] > 0) {
+            pairs.push_back(pair);
+        }
+    }
+    auto shown = std::min(topPairs, pairs.size());
+    std::partial_sort(pairs.begin(), pairs.begin() + shown, pairs.end(),
+                      [&](size_t a, size_t b) { return stats.pairCounts[a] > stats.pairCounts[b]; });
+
+    out << "\n---------- Top " << shown << " opcode pairs ----------\n";
+    for (size_t i = 0; i < shown; i++) {
+        auto pair = pairs[i];
+        auto count = stats.pairCounts[pair];
+        auto name = opcodeToString(pair >> 8) + " " + opcodeToString(pair & 0xff);
+        out << std::left << std::setw(30) << name << std::right << std::setw(14) << count
+            << std::setw(16) << stats.pairCycles[pair] << std::setw(10)
+            << (double)stats.pairCycles[pair] / count << "\n";
+    }
+
+    out.flags(f);
+}
+
+#endif //RETROSEVAVM_EVAOPCODESTATS_H
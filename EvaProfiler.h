@@ -0,0 +1,288 @@
+//
+// Created by Retros on 2023/4/8.
+//
+
+#ifndef RETROSEVAVM_EVAPROFILER_H
+#define RETROSEVAVM_EVAPROFILER_H
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "EvaValue.h"
+#include "Logger.h"
+
+/**
+ * Capacity of the sample buffer between two drains.
+ */
+const size_t PROFILER_MAX_SAMPLES = 64 * 1024;
+
+/**
+ * Capacity of the buffer of the samples' callers between two drains.
+ */
+const size_t PROFILER_MAX_CALLERS = 1024 * 1024;
+
+/**
+ * Sampling profiler.
+ *
+ * A CPU-time timer (SIGPROF) interrupts the VM, and the signal handler
+ * copies the current code object and instruction pointer, and the ones
+ * of the callers (the VM frames), into fixed buffers (allocated by
+ * start(), so an idle profiler costs no memory): the handler doesn't
+ * allocate, lock, or read the bytecode. The samples are resolved to
+ * source lines (through the line tables of the code objects) by drain(),
+ * which the VM calls before the code object dies.
+ *
+ * The result is written as folded stacks ("main:7;f:4 count" lines,
+ * from the outermost caller), the input of flamegraph.pl and similar
+ * tools. Samples taken while the VM is not running code (parsing,
+ * compiling) go to "[vm]"; samples in JIT-compiled code go to the line
+ * of the loop that entered it.
+ */
+class EvaProfiler {
+public:
+    /**
+     * Samples the VM registers at `ip` and `co`, and the callers in `frames`.
+     */
+    EvaProfiler(uint8_t* const* ip, CodeObject* const* co, const std::vector<Frame>* frames)
+        : ip(ip), co(co), frames(frames) {}
+
+    ~EvaProfiler() { stop(); }
+
+    EvaProfiler(const EvaProfiler&) = delete;
+    EvaProfiler& operator=(const EvaProfiler&) = delete;
+
+    /**
+     * Starts sampling at `hz` samples per second of CPU time.
+     * Only one profiler can run at a time.
+     */
+    void start(int hz = 1000) {
+        if (running) {
+            return;
+        }
+        EvaProfiler* expected = nullptr;
+        if (!active.compare_exchange_strong(expected, this)) {
+            DIE << "EvaProfiler: another profiler is running.";
+        }
+
+        // Kept after stop(), for the next run.
+        if (samples == nullptr) {
+            samples = std::make_unique<Sample[]>(PROFILER_MAX_SAMPLES);
+            callers = std::make_unique<Location[]>(PROFILER_MAX_CALLERS);
+        }
+
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = &EvaProfiler::onSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (::sigaction(SIGPROF, &action, &previousAction) != 0) {
+            DIE << "EvaProfiler: cannot install the SIGPROF handler: " << std::strerror(errno);
+        }
+
+        struct itimerval timer;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+        if (::setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+            DIE << "EvaProfiler: cannot start the timer: " << std::strerror(errno);
+        }
+
+        running = true;
+    }
+
+    /**
+     * Stops sampling, and resolves the pending samples.
+     */
+    void stop() {
+        if (!running) {
+            return;
+        }
+
+        struct itimerval timer;
+        std::memset(&timer, 0, sizeof(timer));
+        ::setitimer(ITIMER_PROF, &timer, nullptr);
+        ::sigaction(SIGPROF, &previousAction, nullptr);
+
+        running = false;
+        active = nullptr;
+
+        drain(*co);
+    }
+
+    /**
+     * Resolves the pending samples taken in `code` to source lines.
+     * Must be called before `code` is destroyed.
+     */
+    void drain(const CodeObject* code) {
+        // Never started.
+        if (samples == nullptr) {
+            return;
+        }
+
+        size_t done = 0;
+        for (auto emptied = false; !emptied;) {
+            auto count = samplesCount.load();
+            for (auto i = done; i < count; i++) {
+                resolve(samples[i], code);
+            }
+            done = count;
+
+            // Samples added by the handler meanwhile are resolved
+            // in the next round. The buffers are emptied together.
+            withoutSamples([&] {
+                if (samplesCount.load() == done) {
+                    samplesCount.store(0);
+                    callersCount = 0;
+                    emptied = true;
+                }
+            });
+        }
+    }
+
+    /**
+     * Writes the collected samples as folded stacks.
+     */
+    void writeFolded(std::ostream& out) const {
+        for (auto& stack : stacks) {
+            out << stack.first << " " << stack.second << "\n";
+        }
+        if (dropped > 0) {
+            out << "[dropped] " << dropped << "\n";
+        }
+    }
+
+    bool isRunning() const { return running; }
+
+    /**
+     * Runs `fn` with the samples held back, e.g. while the
+     * sampled frames move.
+     */
+    template <typename Fn>
+    static void withoutSamples(Fn fn) {
+        sigset_t signals, previous;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGPROF);
+        ::pthread_sigmask(SIG_BLOCK, &signals, &previous);
+        fn();
+        ::pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+
+private:
+    /**
+     * An instruction being executed, or a return address.
+     */
+    struct Location {
+        const CodeObject* co;
+        const uint8_t* ip;
+    };
+
+    /**
+     * The callers of a sample are `callersCount` locations
+     * from `firstCaller` in the callers buffer, the outermost first.
+     */
+    struct Sample {
+        Location location;
+        size_t firstCaller;
+        size_t callersCount;
+    };
+
+    /**
+     * SIGPROF handler.
+     */
+    static void onSignal(int) {
+        auto profiler = active.load();
+        if (profiler == nullptr) {
+            return;
+        }
+        auto index = profiler->samplesCount.load();
+        auto firstCaller = profiler->callersCount;
+        auto& frames = *profiler->frames;
+        auto callersCount = frames.size();
+        if (index == PROFILER_MAX_SAMPLES || callersCount > PROFILER_MAX_CALLERS - firstCaller) {
+            profiler->dropped++;
+            return;
+        }
+        for (size_t i = 0; i < callersCount; i++) {
+            profiler->callers[firstCaller + i] = {frames[i].co, frames[i].ip};
+        }
+        profiler->callersCount = firstCaller + callersCount;
+        profiler->samples[index] = {{*profiler->co, *profiler->ip}, firstCaller, callersCount};
+        profiler->samplesCount.store(index + 1);
+    }
+
+    /**
+     * Adds a sample to its folded stack.
+     */
+    void resolve(const Sample& sample, const CodeObject* code) {
+        std::string stack;
+        for (size_t i = 0; i < sample.callersCount; i++) {
+            stack += resolve(callers[sample.firstCaller + i], code) + ";";
+        }
+        stacks[stack + resolve(sample.location, code)]++;
+    }
+
+    /**
+     * Source line of a location: "name:line".
+     */
+    static std::string resolve(const Location& location, const CodeObject* code) {
+        // Functions are never destroyed, so their samples
+        // can be resolved along with the top-level code.
+        if (location.co != nullptr && location.co->isFunction) {
+            code = location.co;
+        }
+
+        // The ip may still point to the previous code object.
+        auto inCode = location.co != nullptr && location.co == code && location.ip >= code->code.data() &&
+                      location.ip < code->code.data() + code->code.size();
+        if (!inCode) {
+            return "[vm]";
+        }
+
+        // The ip is past the opcode being executed (past the call
+        // for a caller).
+        auto offset = (size_t)(location.ip - code->code.data());
+        auto line = code->getLine(offset > 0 ? offset - 1 : 0);
+        return code->name + ":" + std::to_string(line);
+    }
+
+    /**
+     * Sampled VM registers.
+     */
+    uint8_t* const* ip;
+    CodeObject* const* co;
+    const std::vector<Frame>* frames;
+
+    /**
+     * Samples not resolved yet, written by the handler
+     * (PROFILER_MAX_SAMPLES of them once started), and their
+     * callers (PROFILER_MAX_CALLERS).
+     */
+    std::unique_ptr<Sample[]> samples;
+    std::atomic<size_t> samplesCount{0};
+    std::unique_ptr<Location[]> callers;
+    size_t callersCount = 0;
+    volatile sig_atomic_t dropped = 0;
+
+    /**
+     * Sample counts by folded stack.
+     */
+    std::map<std::string, size_t> stacks;
+
+    bool running = false;
+    struct sigaction previousAction;
+
+    /**
+     * The profiler receiving the signals.
+     */
+    static inline std::atomic<EvaProfiler*> active{nullptr};
+};
+
+#endif //RETROSEVAVM_EVAPROFILER_H
@@ -0,0 +1,122 @@
+//
+// Created by Retros on 2023/3/18.
+//
+
+#ifndef RETROSEVAVM_EVASTACK_H
+#define RETROSEVAVM_EVASTACK_H
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "EvaValue.h"
+#include "Logger.h"
+
+/**
+ * Granularity of committing stack memory.
+ */
+const size_t STACK_COMMIT_CHUNK = 64 * 1024;
+
+/**
+ * Operand stack.
+ *
+ * The whole stack limit is reserved as inaccessible virtual memory
+ * followed by a guard page, and is made accessible (committed) from
+ * the bottom in chunks, as deeper code runs. An unused stack costs
+ * no memory, and a stray access past the committed part faults
+ * instead of corrupting the heap.
+ */
+class EvaStack {
+public:
+    explicit EvaStack(size_t limit) : limit(limit) {
+        pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+        reservedBytes = roundUp(limit * sizeof(EvaValue), pageSize);
+
+        auto memory = ::mmap(nullptr, reservedBytes + pageSize, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            DIE << "EvaStack: cannot reserve " << limit << " slots: " << std::strerror(errno);
+        }
+        base = (EvaValue*)memory;
+    }
+
+    ~EvaStack() { ::munmap(base, reservedBytes + pageSize); }
+
+    EvaStack(const EvaStack&) = delete;
+    EvaStack& operator=(const EvaStack&) = delete;
+
+    /**
+     * Makes the bottom `slots` slots accessible.
+     * Returns false if it exceeds the limit.
+     */
+    bool commit(size_t slots) {
+        if (slots > limit) {
+            return false;
+        }
+
+        auto bytes = slots * sizeof(EvaValue);
+        if (bytes <= committedBytes) {
+            return true;
+        }
+
+        auto newCommitted = std::min(roundUp(bytes, STACK_COMMIT_CHUNK), reservedBytes);
+        newCommitted = roundUp(newCommitted, pageSize);
+
+        if (::mprotect(base, newCommitted, PROT_READ | PROT_WRITE) != 0) {
+            DIE << "EvaStack: cannot commit " << slots << " slots: " << std::strerror(errno);
+        }
+        committedBytes = newCommitted;
+        return true;
+    }
+
+    /**
+     * Returns all committed memory to the system (for idle VMs).
+     * The stack contents are lost.
+     */
+    void release() {
+        if (committedBytes == 0) {
+            return;
+        }
+        ::madvise(base, committedBytes, MADV_DONTNEED);
+        ::mprotect(base, committedBytes, PROT_NONE);
+        committedBytes = 0;
+    }
+
+    EvaValue* begin() { return base; }
+
+    EvaValue* end() { return base + limit; }
+
+    EvaValue& operator[](size_t index) { return base[index]; }
+
+    /**
+     * Stack limit, in slots.
+     */
+    size_t size() const { return limit; }
+
+    /**
+     * Accessible slots.
+     */
+    size_t committed() const { return committedBytes / sizeof(EvaValue); }
+
+private:
+    static size_t roundUp(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * Reserved region.
+     */
+    EvaValue* base;
+
+    /**
+     * Stack limit, in slots.
+     */
+    size_t limit;
+
+    size_t pageSize;
+    size_t reservedBytes;
+    size_t committedBytes = 0;
+};
+
+#endif //RETROSEVAVM_EVASTACK_H
@@ -5,18 +5,27 @@
 #ifndef RETROSEVAVM_EVAVM_H
 #define RETROSEVAVM_EVAVM_H
 
-#include <array>
+#include <cmath>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <iostream>
 
 #include "OpCode.h"
 #include "Logger.h"
 #include "Global.h"
+#include "EvaStack.h"
+#include "EvaHeap.h"
+#include "EvaProfiler.h"
+#include "EvaOpcodeStats.h"
+#include "simd/EvaSimd.h"
+#include "MappedFile.h"
 #include "EvaValue.h"
 #include "EvaCompiler.h"
 #include "parser/EvaParser.h"
+#include "parser/EvaFormReader.h"
+#include "jit/EvaJIT.h"
 
 using syntax::EvaParser;
 
@@ -43,18 +52,129 @@ using syntax::EvaParser;
 #define GET_CONST() co->constants[READ_BYTE()]
 
 /**
- * Stack top (stack overflow after exceeding).
+ * Default stack limit in slots (stack overflow after exceeding).
  */
-const size_t STACK_LIMIT = 512;
+const size_t STACK_LIMIT = 1024 * 1024;
 
 
-#define BINARY_OP(op)               \
-do {                                \
-    auto op2 = AS_NUMBER(pop());    \
-    auto op1 = AS_NUMBER(pop());    \
-    push(NUMBER((op1 op op2)));     \
+/**
+ * Offset of the instruction being executed, `size` bytes of which
+ * are already read.
+ */
+#define CURRENT_OFFSET(size) ((size_t)(ip - (size) - co->code.data()))
+
+/**
+ * Integer math: stores the result and returns true if it is
+ * an integer, i.e. doesn't overflow (otherwise the operation
+ * is done on doubles). Division always produces a double.
+ */
+bool intAdd(int64_t a, int64_t b, int64_t* result) { return !__builtin_add_overflow(a, b, result); }
+bool intSub(int64_t a, int64_t b, int64_t* result) { return !__builtin_sub_overflow(a, b, result); }
+bool intMul(int64_t a, int64_t b, int64_t* result) { return !__builtin_mul_overflow(a, b, result); }
+bool intDiv(int64_t, int64_t, int64_t*) { return false; }
+
+/**
+ * Math on numbers: in integers if both operands are ints,
+ * and the result fits, in doubles otherwise.
+ */
+#define NUMERIC_OP(op, intOp, op1, op2)                                                 \
+do {                                                                                    \
+    int64_t intResult;                                                                  \
+    if (IS_INT(op1) && IS_INT(op2) && intOp(AS_INT(op1), AS_INT(op2), &intResult)) {    \
+        push(INT(intResult));                                                           \
+    } else {                                                                            \
+        push(NUMBER(AS_DOUBLE(op1) op AS_DOUBLE(op2)));                                 \
+    }                                                                                   \
 } while (false)
 
+/**
+ * Generic binary math: checks the operand types, and collects
+ * type feedback for quickening to `specializedOp`.
+ */
+#define BINARY_OP(op, intOp, specializedOp)                     \
+do {                                                            \
+    auto op2 = pop();                                           \
+    auto op1 = pop();                                           \
+    if (!IS_NUMERIC(op1) || !IS_NUMERIC(op2)) {                 \
+        DIE << "Type error: (" #op ") expects numbers, got "    \
+            << evaValueToTypeString(op1) << " and "             \
+            << evaValueToTypeString(op2);                       \
+    }                                                           \
+    recordNumberOperands(CURRENT_OFFSET(1), specializedOp);     \
+    NUMERIC_OP(op, intOp, op1, op2);                            \
+} while (false)
+
+/**
+ * Number-specialized binary math: operand types are guarded
+ * by the caller (see NUMBER_OPERANDS).
+ */
+#define NUMBER_BINARY_OP(op, intOp)     \
+do {                                    \
+    auto op2 = pop();                   \
+    auto op1 = pop();                   \
+    NUMERIC_OP(op, intOp, op1, op2);    \
+} while (false)
+
+/**
+ * Type guard of number-specialized instructions
+ * (ints or doubles).
+ */
+#define NUMBER_OPERANDS() (IS_NUMERIC(peek(0)) && IS_NUMERIC(peek(1)))
+
+/**
+ * Compares two numbers: as integers if both are ints.
+ */
+#define COMPARE_NUMBERS(op, op1, op2)                       \
+do {                                                        \
+    if (IS_INT(op1) && IS_INT(op2)) {                       \
+        COMPARE_VALUES(op, AS_INT(op1), AS_INT(op2));       \
+    } else {                                                \
+        COMPARE_VALUES(op, AS_DOUBLE(op1), AS_DOUBLE(op2)); \
+    }                                                       \
+} while (false)
+
+/**
+ * Rewrites the current instruction to its generic version,
+ * and re-dispatches it (operands are not consumed yet).
+ */
+#define DEOPTIMIZE(genericOp)                           \
+do {                                                    \
+    --ip;                                               \
+    deoptimize(CURRENT_OFFSET(0), genericOp);           \
+} while (false)
+
+/**
+ * Consecutive executions with number operands after which
+ * a generic instruction is quickened.
+ */
+const uint8_t QUICKEN_THRESHOLD = 8;
+
+/**
+ * Failed type guards after which an instruction
+ * stays generic.
+ */
+const uint8_t MAX_DEOPTS = 4;
+
+/**
+ * Instructions between incremental GC steps.
+ */
+const size_t GC_STEP_INTERVAL = 1024;
+
+/**
+ * Quickening counters.
+ */
+struct QuickeningStats {
+    /**
+     * Instructions rewritten to a specialized version.
+     */
+    size_t quickened = 0;
+
+    /**
+     * Instructions rewritten back to a generic version.
+     */
+    size_t deoptimized = 0;
+};
+
 #define COMPARE_VALUES(op, v1, v2)  \
 do {                                \
     bool res;                       \
@@ -87,21 +207,79 @@ do {                                \
  */
 class EvaVM {
 public:
-    EvaVM() :
+    explicit EvaVM(size_t stackLimit = STACK_LIMIT) :
         parser(std::make_unique<EvaParser>()),
         global(std::make_shared<Global>()),
-        compiler(std::make_unique<EvaCompiler>(global)) {
+        compiler(std::make_unique<EvaCompiler>(global)),
+        stack(stackLimit) {
         setGlobalVariables();
     }
 
     /*
      * Executes a program.
      */
-    EvaValue exec(const std::string &program) {
-        // 1. parse the program
-        auto ast = parser->parse("(begin " + program + ")");
+    EvaValue exec(std::string_view program) {
+        EvaFormReader reader(program);
+        return exec(reader);
+    }
+
+    /**
+     * Executes a script file. The file is mapped read-only
+     * and scanned in place.
+     */
+    EvaValue execFile(const std::string &path) {
+        MappedFile file(path);
+        return exec(file.view());
+    }
+
+    /**
+     * Executes a program read from a file descriptor.
+     */
+    EvaValue execFd(int fd) {
+        auto reader = EvaFormReader::fromFd(fd);
+        return exec(reader);
+    }
+
+    /**
+     * Executes top-level forms one by one as soon as each
+     * of them is complete. The result is the value of the last form.
+     */
+    EvaValue exec(EvaFormReader &reader) {
+        auto result = NUMBER(0);
+        std::string_view form;
+
+        while (reader.next(form)) {
+            result = execForm(form, reader.formLine);
+        }
+
+        return result;
+    }
+
+    /**
+     * Executes a single top-level form, starting at `line` of the source.
+     */
+    EvaValue execForm(std::string_view form, size_t line = 1) {
+        // Code of the previous form is not needed anymore
+        // (once its profile samples are resolved).
+        auto previous = co;
+        co = nullptr;
+        profiler.drain(previous);
+        delete previous;
 
-        // 2. Compile program to Eva bytecode
+        // 1. parse the form, and wrap it into a global (begin <form>)
+        // (the tokenizer throws its errors by pointer).
+        std::string begin = "begin";
+        std::vector<Exp> program{Exp(begin)};
+        try {
+            program.push_back(parser->parse(form, (int)line));
+        } catch (const std::runtime_error& e) {
+            DIE << e.what();
+        } catch (const std::runtime_error* e) {
+            DIE << e->what();
+        }
+        auto ast = Exp(std::move(program));
+
+        // 2. Compile program to Eva bytecode.
         co = compiler->compile(ast);
 
 
@@ -110,25 +288,106 @@ public:
         // 3. set instruction pointer to the beginning:
         ip = &co->code[0];
 
-        sp = &stack[0];
-        bp = &stack[0];
+        sp = stack.begin();
+        bp = stack.begin();
+        frames.clear();
+
+        // The only overflow check: the stack depth is
+        // known statically, push() doesn't check it.
+        if (!stack.commit((sp - stack.begin()) + co->maxStackDepth)) {
+            DIE << "Stack overflow: " << co->name << " needs " << co->maxStackDepth
+                << " slots, " << (stack.end() - sp) << " available.";
+        }
 
         compiler-> disassembleBytecode();
 
-        return eval();
+#ifdef EVA_OPCODE_STATS
+        // Pairs are tracked across the calls from the host (see call()).
+        opcodeCounter.begin();
+#endif
+        auto result = eval();
+
+        // Young objects die with the execution,
+        // except for the result.
+        result = heap.promote(result);
+        heap.resetNursery();
+
+        return result;
     }
 
     /**
-     * Main eval loop
+     * Calls a function (a closure or a native) from the host, e.g. a
+     * native calling back a lambda passed to it, and returns its result.
+     * The arguments may be on the stack (as the ones of a native).
+     */
+    EvaValue call(const EvaValue& fn, NativeArgs args) {
+        if (IS_NATIVE(fn)) {
+            auto native = AS_NATIVE(fn);
+            if (native->arity != VARIADIC && (size_t)native->arity != args.size()) {
+                DIE << "call: " << native->name << " expects " << native->arity << " arguments, got "
+                    << args.size();
+            }
+            return native->function(args);
+        }
+
+        if (!IS_CLOSURE(fn) || args.size() > 255) {
+            DIE << "call: " << fn << " is not a function of at most 255 arguments";
+        }
+
+        // The callee and the arguments, above the caller's stack.
+        if (!stack.commit((sp - stack.begin()) + 1 + args.size())) {
+            DIE << "Stack overflow: calling " << fn;
+        }
+        push(fn);
+        for (auto& arg : args) {
+            push(arg);
+        }
+
+        // OP_RETURN from this frame leaves the eval loop.
+        auto outerHostFrames = hostFrames;
+        callClosure(AS_CLOSURE(fn), (uint8_t)args.size());
+        hostFrames = frames.size();
+
+        auto result = eval();
+        hostFrames = outerHostFrames;
+        return result;
+    }
+
+    /**
+     * Main eval loop: verified code runs unchecked.
      */
+    EvaValue eval() {
+        return co->verified && uncheckedEnabled ? eval<false>() : eval<true>();
+    }
+
+    /**
+     * Eval loop. The checked version validates the operands
+     * of each instruction, for code that isn't verified.
+     */
+    template <bool checked>
     EvaValue eval() {
         for (;;) {
+            // Incremental GC slice between instructions.
+            if (--gcCountdown == 0) {
+                gcCountdown = GC_STEP_INTERVAL;
+                heap.step();
+            }
+
+#ifdef EVA_OPCODE_STATS
+            opcodeCounter.record(*ip);
+#endif
+
             auto opcode = READ_BYTE();
             switch (opcode) {
                 case OP_HALT: {
                     return pop();
                 }
                 case OP_CONST: {
+                    if constexpr (checked) {
+                        if (*ip >= co->constants.size()) {
+                            DIE << "OP_CONST: invalid constant index: " << (int)*ip;
+                        }
+                    }
                     push(GET_CONST());
                     break;
                 }
@@ -136,28 +395,63 @@ public:
                     auto op2 = pop();
                     auto op1 = pop();
 
-                    if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-                        auto v1 = AS_NUMBER(op1);
-                        auto v2 = AS_NUMBER(op2);
-                        push(NUMBER(v1 + v2));
+                    if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {
+                        recordNumberOperands(CURRENT_OFFSET(1), OP_ADD_NUM);
+                        NUMERIC_OP(+, intAdd, op1, op2);
                     } else if (IS_STRING(op1) && IS_STRING(op2)) {
-                        auto v1 = AS_CPPSTRING(op1);
-                        auto v2 = AS_CPPSTRING(op2);
-                        push(ALLOC_STRING(v1 + v2));
+                        resetNumberOperands(CURRENT_OFFSET(1));
+                        push(heap.allocString(AS_CPPSTRING(op1) + AS_CPPSTRING(op2)));
+                    } else {
+                        resetNumberOperands(CURRENT_OFFSET(1));
+                        DIE << "Type error: (+) expects two numbers or two strings, got "
+                            << evaValueToTypeString(op1) << " and " << evaValueToTypeString(op2);
                     }
 
                     break;
                 }
                 case OP_SUB: {
-                    BINARY_OP(-);
+                    BINARY_OP(-, intSub, OP_SUB_NUM);
                     break;
                 }
                 case OP_MUL: {
-                    BINARY_OP(*);
+                    BINARY_OP(*, intMul, OP_MUL_NUM);
                     break;
                 }
                 case OP_DIV: {
-                    BINARY_OP(/);
+                    BINARY_OP(/, intDiv, OP_DIV_NUM);
+                    break;
+                }
+
+                case OP_ADD_NUM: {
+                    if (!NUMBER_OPERANDS()) {
+                        DEOPTIMIZE(OP_ADD);
+                        break;
+                    }
+                    NUMBER_BINARY_OP(+, intAdd);
+                    break;
+                }
+                case OP_SUB_NUM: {
+                    if (!NUMBER_OPERANDS()) {
+                        DEOPTIMIZE(OP_SUB);
+                        break;
+                    }
+                    NUMBER_BINARY_OP(-, intSub);
+                    break;
+                }
+                case OP_MUL_NUM: {
+                    if (!NUMBER_OPERANDS()) {
+                        DEOPTIMIZE(OP_MUL);
+                        break;
+                    }
+                    NUMBER_BINARY_OP(*, intMul);
+                    break;
+                }
+                case OP_DIV_NUM: {
+                    if (!NUMBER_OPERANDS()) {
+                        DEOPTIMIZE(OP_DIV);
+                        break;
+                    }
+                    NUMBER_BINARY_OP(/, intDiv);
                     break;
                 }
 
@@ -170,22 +464,74 @@ public:
                     auto op2 = pop();
                     auto op1 = pop();
 
-                    if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-                        auto v1 = AS_NUMBER(op1);
-                        auto v2 = AS_NUMBER(op2);
-                        COMPARE_VALUES(op, v1, v2);
+                    if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {
+                        recordNumberOperands(CURRENT_OFFSET(2), OP_COMPARE_NUM);
+                        COMPARE_NUMBERS(op, op1, op2);
                     } else if (IS_STRING(op1) && IS_STRING(op2)) {
+                        resetNumberOperands(CURRENT_OFFSET(2));
                         auto v1 = AS_CPPSTRING(op1);
                         auto v2 = AS_CPPSTRING(op2);
                         COMPARE_VALUES(op, v1, v2);
+                    } else if (IS_BOOLEAN(op1) && IS_BOOLEAN(op2)) {
+                        resetNumberOperands(CURRENT_OFFSET(2));
+                        auto v1 = AS_BOOLEAN(op1);
+                        auto v2 = AS_BOOLEAN(op2);
+                        COMPARE_VALUES(op, v1, v2);
+                    } else {
+                        DIE << "Type error: cannot compare "
+                            << evaValueToTypeString(op1) << " and " << evaValueToTypeString(op2);
+                    }
+                    break;
+                }
+
+                case OP_COMPARE_NUM: {
+                    if (!NUMBER_OPERANDS()) {
+                        DEOPTIMIZE(OP_COMPARE);
+                        break;
                     }
+                    auto op = READ_BYTE();
+
+                    auto op2 = pop();
+                    auto op1 = pop();
+                    COMPARE_NUMBERS(op, op1, op2);
                     break;
                 }
 
                 case OP_JMP_IF_FALSE: {
-                    auto cond = AS_BOOLEAN(pop());
+                    auto cond = pop();
+                    auto isFalsy = IS_FALSY(cond);
                     auto address = READ_SHORT();
-                    if (!cond) {
+                    if (isFalsy) {
+                        ip = TO_ADDRESS(address);
+                    }
+                    break;
+                }
+
+                case OP_PUSH_SMALLINT8: {
+                    push(INT((int8_t)READ_BYTE()));
+                    break;
+                }
+
+                case OP_PUSH_SMALLINT16: {
+                    push(INT((int16_t)READ_SHORT()));
+                    break;
+                }
+
+                case OP_PUSH_TRUE: {
+                    push(BOOLEAN(true));
+                    break;
+                }
+
+                case OP_PUSH_FALSE: {
+                    push(BOOLEAN(false));
+                    break;
+                }
+
+                case OP_JMP_IF_TRUE: {
+                    auto cond = pop();
+                    auto isFalsy = IS_FALSY(cond);
+                    auto address = READ_SHORT();
+                    if (!isFalsy) {
                         ip = TO_ADDRESS(address);
                     }
                     break;
@@ -193,23 +539,100 @@ public:
 
                 case OP_JMP: {
                     auto address = READ_SHORT();
+
+#ifdef EVA_JIT_ENABLED
+                    // Loop back-edge: continue in machine code once hot.
+                    if (address < CURRENT_OFFSET(3) && enterJit(address)) {
+                        break;
+                    }
+#endif
+
                     ip = TO_ADDRESS(address);
                     break;
                 }
 
+                case OP_LOOP_INC_LT: {
+                    auto localIndex = READ_BYTE();
+                    auto address = READ_SHORT();
+                    if constexpr (checked) {
+                        if (localIndex + 2 >= sp - bp) {
+                            DIE << "OP_LOOP_INC_LT: invalid variable index: " << (int)localIndex;
+                        }
+                    }
+
+                    auto& counter = bp[localIndex];
+                    auto& end = bp[localIndex + 1];
+                    auto& step = bp[localIndex + 2];
+                    if (!IS_NUMERIC(counter) || !IS_NUMERIC(end) || !IS_NUMERIC(step)) {
+                        DIE << "Type error: (for) expects numbers, got " << evaValueToTypeString(counter)
+                            << ", " << evaValueToTypeString(end) << " and " << evaValueToTypeString(step);
+                    }
+
+                    int64_t next;
+                    if (IS_INT(counter) && IS_INT(step) && intAdd(AS_INT(counter), AS_INT(step), &next)) {
+                        counter = INT(next);
+                    } else {
+                        counter = NUMBER(AS_DOUBLE(counter) + AS_DOUBLE(step));
+                    }
+
+                    auto loop = IS_INT(counter) && IS_INT(end) ? AS_INT(counter) < AS_INT(end)
+                                                               : AS_DOUBLE(counter) < AS_DOUBLE(end);
+                    if (!loop) {
+                        break;
+                    }
+
+#ifdef EVA_JIT_ENABLED
+                    if (enterJit(address)) {
+                        break;
+                    }
+#endif
+
+                    ip = TO_ADDRESS(address);
+                    break;
+                }
+
+                case OP_TABLE_SWITCH: {
+                    if constexpr (checked) {
+                        checkSwitchTable();
+                    }
+                    auto& table = co->switchTables[READ_BYTE()];
+                    ip = TO_ADDRESS(tableSwitchTarget(table, pop()));
+                    break;
+                }
+
+                case OP_LOOKUP_SWITCH: {
+                    if constexpr (checked) {
+                        checkSwitchTable();
+                    }
+                    auto& table = co->switchTables[READ_BYTE()];
+                    ip = TO_ADDRESS(lookupSwitchTarget(table, pop()));
+                    break;
+                }
+
                 // -------------------------
                 // Global Variable value:
                 case OP_GET_GLOBAL: {
                     auto globalIndex = READ_BYTE();
+                    if constexpr (checked) {
+                        if (globalIndex >= global->globals.size()) {
+                            DIE << "OP_GET_GLOBAL: invalid global index: " << (int)globalIndex;
+                        }
+                    }
                     push(global->get(globalIndex).value);
                     break;
                 }
 
                 case OP_SET_GLOBAL: {
                     auto globalIndex = READ_BYTE();
-                    auto value = peek(0);
-                    global->set(globalIndex, value);
-                    push(global->get(globalIndex).value);
+
+                    // The value escapes the execution.
+                    auto value = heap.promote(peek(0));
+                    heap.writeBarrier(value);
+                    if constexpr (checked) {
+                        global->set(globalIndex, value);
+                    } else {
+                        global->get(globalIndex).value = value;
+                    }
                     break;
                 }
 
@@ -220,8 +643,10 @@ public:
 
                 case OP_GET_LOCAL: {
                     auto localIndex = READ_BYTE();
-                    if (localIndex < 0 || localIndex >= stack.size()) {
-                        DIE << "OP_GET_LOCAL: invalid variable index: " << (int)localIndex;
+                    if constexpr (checked) {
+                        if (localIndex >= sp - bp) {
+                            DIE << "OP_GET_LOCAL: invalid variable index: " << (int)localIndex;
+                        }
                     }
                     push(bp[localIndex]);
                     break;
@@ -230,8 +655,10 @@ public:
                 case OP_SET_LOCAL: {
                     auto localIndex = READ_BYTE();
                     auto value = peek(0);
-                    if (localIndex < 0 || localIndex >= stack.size()) {
-                        DIE << "OP_SET_LOCAL: invalid variable index: " << (int)localIndex;
+                    if constexpr (checked) {
+                        if (localIndex >= sp - bp) {
+                            DIE << "OP_SET_LOCAL: invalid variable index: " << (int)localIndex;
+                        }
                     }
                     bp[localIndex] = value;
                     break;
@@ -247,37 +674,306 @@ public:
                     break;
                 }
 
+                // -------------------------
+                // Function calls:
+                case OP_CALL: {
+                    auto argc = READ_BYTE();
+                    auto fn = peek(argc);
+
+                    if (IS_CLOSURE(fn)) {
+                        callClosure(AS_CLOSURE(fn), argc);
+                        break;
+                    }
+
+                    if (!IS_NATIVE(fn)) {
+                        DIE << "OP_CALL: " << fn << " is not a function";
+                    }
+
+                    auto native = AS_NATIVE(fn);
+                    if (native->arity != VARIADIC && native->arity != argc) {
+                        DIE << "OP_CALL: " << native->name << " expects " << native->arity
+                            << " arguments, got " << (int)argc;
+                    }
+
+                    // The arguments are passed in place.
+                    auto result = native->function({sp - argc, argc});
+
+                    popN(argc + 1);
+                    push(result);
+                    break;
+                }
+
+                case OP_RETURN: {
+                    auto result = pop();
+
+                    // The callee and the arguments.
+                    sp = bp - 1;
+
+                    // Called from the host (see call()).
+                    auto toHost = frames.size() == hostFrames;
+
+                    auto& caller = frames.back();
+                    ip = caller.ip;
+                    bp = caller.bp;
+                    co = caller.co;
+                    frames.pop_back();
+
+                    if (toHost) {
+                        return result;
+                    }
+
+                    push(result);
+                    break;
+                }
+
+                // -------------------------
+                // Closures:
+                case OP_CLOSURE: {
+                    if constexpr (checked) {
+                        checkClosure();
+                    }
+                    auto code = AS_CODE(GET_CONST());
+                    auto count = READ_BYTE();
+
+                    // Allocated first: a collection moves the captured values.
+                    auto closure = heap.allocClosure(code, count);
+                    for (size_t i = 0; i < count; i++) {
+                        auto isLocal = READ_BYTE();
+                        auto index = READ_BYTE();
+                        closure->upvalues()[i] = isLocal ? bp[index] : currentClosure()->upvalues()[index];
+                    }
+
+                    push((EvaValue){EvaValueType::OBJECT, .object = closure});
+                    break;
+                }
+
+                case OP_GET_UPVALUE: {
+                    auto index = READ_BYTE();
+                    if constexpr (checked) {
+                        checkUpvalue(index);
+                    }
+                    auto& upvalue = currentClosure()->upvalues()[index];
+                    push(IS_BOX(upvalue) ? AS_BOX(upvalue)->value : upvalue);
+                    break;
+                }
+
+                case OP_SET_UPVALUE: {
+                    auto index = READ_BYTE();
+                    if constexpr (checked) {
+                        checkUpvalue(index);
+                    }
+                    auto& upvalue = currentClosure()->upvalues()[index];
+                    // Checked in verified code too: the verifier doesn't
+                    // know which values are boxes.
+                    if (!IS_BOX(upvalue)) {
+                        DIE << "OP_SET_UPVALUE: upvalue " << (int)index << " is not assigned";
+                    }
+                    setBoxed(upvalue, peek(0));
+                    break;
+                }
+
+                case OP_BOX: {
+                    auto value = pop();
+                    push(heap.allocBox(value));
+                    break;
+                }
+
+                case OP_GET_BOXED: {
+                    auto localIndex = READ_BYTE();
+                    auto& box = bp[localIndex];
+                    if constexpr (checked) {
+                        if (localIndex >= sp - bp) {
+                            DIE << "OP_GET_BOXED: invalid variable index: " << (int)localIndex;
+                        }
+                    }
+                    // Checked in verified code too (see OP_SET_UPVALUE).
+                    if (!IS_BOX(box)) {
+                        DIE << "OP_GET_BOXED: variable " << (int)localIndex << " is not boxed";
+                    }
+                    push(AS_BOX(box)->value);
+                    break;
+                }
+
+                case OP_SET_BOXED: {
+                    auto localIndex = READ_BYTE();
+                    auto& box = bp[localIndex];
+                    if constexpr (checked) {
+                        if (localIndex >= sp - bp) {
+                            DIE << "OP_SET_BOXED: invalid variable index: " << (int)localIndex;
+                        }
+                    }
+                    // Checked in verified code too (see OP_SET_UPVALUE).
+                    if (!IS_BOX(box)) {
+                        DIE << "OP_SET_BOXED: variable " << (int)localIndex << " is not boxed";
+                    }
+                    setBoxed(box, peek(0));
+                    break;
+                }
+
+                // -------------------------
+                // Arrays:
+                case OP_ARRAY: {
+                    auto count = READ_BYTE();
+
+                    std::vector<double> values(count);
+                    for (size_t i = 0; i < count; i++) {
+                        auto& value = *(sp - count + i);
+                        if (!IS_NUMERIC(value)) {
+                            DIE << "OP_ARRAY: arrays hold numbers, got " << value;
+                        }
+                        values[i] = AS_DOUBLE(value);
+                    }
+
+                    popN(count);
+                    push(heap.allocArray(std::move(values)));
+                    break;
+                }
+
+                case OP_GET_INDEX: {
+                    auto index = pop();
+                    auto container = pop();
+
+                    if (IS_MAP(container)) {
+                        auto value = AS_MAP(container)->find(mapKey(index, "get"));
+                        if (value == nullptr) {
+                            DIE << "get: key " << index << " not found";
+                        }
+                        push(*value);
+                        break;
+                    }
+
+                    auto& values = arrayArg(container, "get");
+                    push(NUMBER(values[arrayIndex(values, index)]));
+                    break;
+                }
+
+                case OP_SET_INDEX: {
+                    auto value = pop();
+                    auto index = pop();
+                    auto container = pop();
+
+                    if (IS_MAP(container)) {
+                        mapSet(AS_MAP(container), index, value);
+                        push(value);
+                        break;
+                    }
+
+                    auto& values = arrayArg(container, "put");
+                    if (!IS_NUMERIC(value)) {
+                        DIE << "put: arrays hold numbers, got " << value;
+                    }
+                    values[arrayIndex(values, index)] = AS_DOUBLE(value);
+                    push(value);
+                    break;
+                }
+
+                // -------------------------
+                // Maps:
+                case OP_MAP: {
+                    auto count = READ_BYTE();
+
+                    // Rooted on the stack while the entries are added.
+                    auto map = heap.allocMap();
+                    auto entries = sp - 2 * count;
+                    for (size_t i = 0; i < count; i++) {
+                        mapSet(AS_MAP(map), entries[2 * i], entries[2 * i + 1]);
+                    }
+
+                    popN(2 * count);
+                    push(map);
+                    break;
+                }
+
+                case OP_HAS_KEY: {
+                    auto key = pop();
+                    auto map = pop();
+                    push(BOOLEAN(mapArg(map, "has")->find(mapKey(key, "has")) != nullptr));
+                    break;
+                }
+
+                case OP_DELETE_KEY: {
+                    auto key = pop();
+                    auto map = pop();
+                    push(BOOLEAN(mapArg(map, "del")->remove(mapKey(key, "del"))));
+                    break;
+                }
+
 
                 default:
                     DIE << "Unknown opcode: " << std::hex << static_cast<int>(opcode);
             }
 
-            for (int i = 0; i < STACK_LIMIT; i++)
-                if (std::abs(AS_NUMBER(stack[i]) - 0) > 1e-6)
-                    std::cout << AS_NUMBER(stack[i]) << " ";
+#ifdef EVA_TRACE_STACK
+            for (auto slot = stack.begin(); slot < sp; slot++)
+                std::cout << *slot << " ";
             std::cout << std::endl;
             std::cout << sp - bp << std::endl;
+#endif
         }
     }
 
+#ifdef EVA_JIT_ENABLED
     /**
-     * Pushes a value onto the stack.
+     * Counts a loop back-edge to `address`, and once the code object
+     * is hot runs it in machine code from there, until it leaves
+     * to the interpreter. Returns false if the interpreter continues
+     * with the jump itself.
      */
-    void push(EvaValue value) {
-        if ((size_t) (sp - stack.begin()) == STACK_LIMIT) {
-            DIE << "push(): Stack overflow.\n";
+    bool enterJit(size_t address) {
+        if (!jitEnabled || ++co->backEdges < JIT_THRESHOLD) {
+            return false;
         }
+
+        if (co->jitCode == nullptr) {
+            // Compile once, a failure is not retried.
+            if (co->backEdges > JIT_THRESHOLD) {
+                return false;
+            }
+            co->jitCode = jit.compile(co);
+            if (co->jitCode == nullptr) {
+                return false;
+            }
+        }
+
+        JitFrame frame{sp, bp, co->constants.data(), global->globals.data()};
+        auto resumeAddress = co->jitCode->run(&frame, address);
+
+        sp = frame.sp;
+        ip = TO_ADDRESS(resumeAddress);
+        return true;
+    }
+
+    /**
+     * Baseline JIT compiler.
+     */
+    EvaJIT jit;
+#endif
+
+    /**
+     * Whether hot loops are compiled to machine code
+     * (when built with EVA_JIT).
+     */
+    bool jitEnabled = true;
+
+    /**
+     * Whether verified code runs in the unchecked eval loop.
+     */
+    bool uncheckedEnabled = true;
+
+    /**
+     * Pushes a value onto the stack. Unchecked: the space
+     * is reserved for the code object's maxStackDepth on entry.
+     */
+    void push(EvaValue value) {
         *sp = value;
         ++sp;
     }
 
     /**
-     * Pops a value from the stack.
+     * Pops a value from the stack. Unchecked: the compiler
+     * verified that code never pops below its entry depth.
      */
     EvaValue pop() {
-        if (stack.size() == 0) {
-            DIE << "pop(): empty stack.\n";
-        }
         --sp;
         return *sp;
     }
@@ -287,9 +983,6 @@ public:
      * Peeks an element from the stack.
      */
     EvaValue peek(size_t offset = 0) {
-        if (stack.size() == 0) {
-            DIE << "peek(): empty stack.\n";
-        }
         return *(sp - 1 - offset);
     }
 
@@ -297,19 +990,457 @@ public:
      * Pops multiple values from the stack.
      */
     void popN(size_t count) {
-        if (stack.size() == 0) {
-            DIE << "popN(): empty stack.\n";
-        }
         sp -= count;
     }
 
 
+    // ------------------------------------
+    // Quickening
+
+    /**
+     * A generic instruction saw number operands: rewrites it
+     * to `specializedOp` once this is stable.
+     */
+    void recordNumberOperands(size_t offset, uint8_t specializedOp) {
+        auto& cache = co->getInlineCache(offset);
+        if (cache.deopts >= MAX_DEOPTS) {
+            return;
+        }
+        if (++cache.hits >= QUICKEN_THRESHOLD) {
+            cache.hits = 0;
+            co->rewriteOpcode(offset, specializedOp);
+            quickeningStats.quickened++;
+        }
+    }
+
+    /**
+     * A generic instruction saw other operands.
+     */
+    void resetNumberOperands(size_t offset) {
+        co->getInlineCache(offset).hits = 0;
+    }
+
+    /**
+     * A specialized instruction failed its type guard:
+     * rewrites it back to `genericOp`.
+     */
+    void deoptimize(size_t offset, uint8_t genericOp) {
+        auto& cache = co->getInlineCache(offset);
+        cache.hits = 0;
+        if (cache.deopts < MAX_DEOPTS) {
+            cache.deopts++;
+        }
+        co->rewriteOpcode(offset, genericOp);
+        quickeningStats.deoptimized++;
+    }
+
+    /**
+     * Restores the current code object, and the functions compiled
+     * in the previous forms too, to their compiled bytecode, and
+     * drops the collected type feedback.
+     */
+    void resetQuickening() {
+        if (co != nullptr) {
+            co->resetQuickening();
+        }
+        for (auto function : compiler->getCompiledFunctions()) {
+            function->resetQuickening();
+        }
+    }
+
+    /**
+     * Returns the garbage collector counters.
+     */
+    const GCStats& getGCStats() const { return heap.getStats(); }
+
+#ifdef EVA_OPCODE_STATS
+    /**
+     * Returns the per-opcode execution counters.
+     */
+    const OpcodeStats& getOpcodeStats() const { return opcodeCounter.stats; }
+
+    void resetOpcodeStats() { opcodeCounter.stats.reset(); }
+#endif
+
+    /**
+     * Starts the sampling profiler.
+     */
+    void startProfiling(int hz = 1000) { profiler.start(hz); }
+
+    /**
+     * Stops the sampling profiler, and writes the profile
+     * as folded stacks.
+     */
+    void writeProfile(std::ostream& out) {
+        profiler.stop();
+        profiler.writeFolded(out);
+    }
+
+    /**
+     * Returns the memory of the operand stack to the system,
+     * e.g. for a pooled VM going idle.
+     */
+    void trimStack() { stack.release(); }
+
+    /**
+     * Turns the compiler optimizations on or off
+     * (e.g. to compare the results).
+     */
+    void setOptimizationsEnabled(bool enabled) { compiler->optimizationsEnabled = enabled; }
+
+    /**
+     * Returns the bytecode optimizer counters.
+     */
+    const OptimizerStats& getOptimizerStats() const { return compiler->getOptimizerStats(); }
+
+    /**
+     * Returns the quickening counters.
+     */
+    const QuickeningStats& getQuickeningStats() const { return quickeningStats; }
+
     /**
      * Sets up global variables and functions.
      */
     void setGlobalVariables() {
-        global->addConst("VERSION", 1);
-        global->addConst("y", 20);
+        global->addConst("VERSION", INT(1));
+        global->addConst("y", INT(20));
+
+        // Math:
+        global->addNativeFunction(
+            "sqrt", [](NativeArgs args) { return NUMBER(std::sqrt(numberArg(args, 0, "sqrt"))); }, 1);
+
+        global->addNativeFunction(
+            "abs", [](NativeArgs args) { return NUMBER(std::fabs(numberArg(args, 0, "abs"))); }, 1);
+
+        global->addNativeFunction(
+            "floor", [](NativeArgs args) { return NUMBER(std::floor(numberArg(args, 0, "floor"))); }, 1);
+
+        global->addNativeFunction(
+            "pow",
+            [](NativeArgs args) { return NUMBER(std::pow(numberArg(args, 0, "pow"), numberArg(args, 1, "pow"))); },
+            2);
+
+        // Arrays:
+        global->addNativeFunction(
+            "make-array",
+            [this](NativeArgs args) {
+                auto size = numberArg(args, 0, "make-array");
+                if (size < 0 || size != std::floor(size)) {
+                    DIE << "make-array(): invalid size " << size;
+                }
+                return heap.allocArray(std::vector<double>((size_t)size, numberArg(args, 1, "make-array")));
+            },
+            2);
+
+        global->addNativeFunction(
+            "len",
+            [](NativeArgs args) {
+                if (IS_MAP(args[0])) {
+                    return INT(AS_MAP(args[0])->size());
+                }
+                return INT(arrayArg(args[0], "len").size());
+            },
+            1);
+
+        // (map-array <array> <fn>): a new array of the results of the function
+        // (e.g. a lambda) called back with each element.
+        global->addNativeFunction(
+            "map-array",
+            [this](NativeArgs args) {
+                auto& a = arrayArg(args[0], "map-array");
+                std::vector<double> out;
+                out.reserve(a.size());
+                for (size_t i = 0; i < a.size(); i++) {
+                    auto element = NUMBER(a[i]);
+                    auto result = call(args[1], {&element, 1});
+                    out.push_back(numberArg({&result, 1}, 0, "map-array"));
+                }
+                return heap.allocArray(std::move(out));
+            },
+            2);
+
+        // Bulk array operations, vectorized (see simd/EvaSimd.h).
+        global->addNativeFunction(
+            "vsum",
+            [](NativeArgs args) {
+                auto& a = arrayArg(args[0], "vsum");
+                return NUMBER(simdKernels().sum(a.data(), a.size()));
+            },
+            1);
+
+        global->addNativeFunction(
+            "vdot",
+            [](NativeArgs args) {
+                auto& a = arrayArg(args[0], "vdot");
+                auto& b = sameSizeArrayArg(args[1], a, "vdot");
+                return NUMBER(simdKernels().dot(a.data(), b.data(), a.size()));
+            },
+            2);
+
+        global->addNativeFunction(
+            "vmin",
+            [](NativeArgs args) {
+                auto& a = nonEmptyArrayArg(args[0], "vmin");
+                return NUMBER(simdKernels().min(a.data(), a.size()));
+            },
+            1);
+
+        global->addNativeFunction(
+            "vmax",
+            [](NativeArgs args) {
+                auto& a = nonEmptyArrayArg(args[0], "vmax");
+                return NUMBER(simdKernels().max(a.data(), a.size()));
+            },
+            1);
+
+        global->addNativeFunction(
+            "vadd",
+            [this](NativeArgs args) {
+                auto& a = arrayArg(args[0], "vadd");
+                auto& b = sameSizeArrayArg(args[1], a, "vadd");
+                std::vector<double> out(a.size());
+                simdKernels().add(a.data(), b.data(), out.data(), a.size());
+                return heap.allocArray(std::move(out));
+            },
+            2);
+
+        global->addNativeFunction(
+            "vmul",
+            [this](NativeArgs args) {
+                auto& a = arrayArg(args[0], "vmul");
+                auto& b = sameSizeArrayArg(args[1], a, "vmul");
+                std::vector<double> out(a.size());
+                simdKernels().mul(a.data(), b.data(), out.data(), a.size());
+                return heap.allocArray(std::move(out));
+            },
+            2);
+
+        // I/O: prints the arguments, returns the number of them.
+        global->addNativeFunction(
+            "print",
+            [](NativeArgs args) {
+                for (size_t i = 0; i < args.size(); i++) {
+                    auto& value = args[i];
+                    std::cout << (i > 0 ? " " : "")
+                              << (IS_STRING(value) ? AS_CPPSTRING(value) : evaValueToConstantString(value));
+                }
+                std::cout << "\n";
+                return INT(args.size());
+            },
+            VARIADIC);
+    }
+
+    /**
+     * Returns the elements of an array operand.
+     */
+    static std::vector<double>& arrayArg(const EvaValue& value, const char* name) {
+        if (!IS_ARRAY(value)) {
+            DIE << name << "(): expected an array, got " << value;
+        }
+        return AS_ARRAY(value)->values;
+    }
+
+    static std::vector<double>& nonEmptyArrayArg(const EvaValue& value, const char* name) {
+        auto& values = arrayArg(value, name);
+        if (values.empty()) {
+            DIE << name << "(): empty array";
+        }
+        return values;
+    }
+
+    static std::vector<double>& sameSizeArrayArg(const EvaValue& value, const std::vector<double>& other,
+                                                 const char* name) {
+        auto& values = arrayArg(value, name);
+        if (values.size() != other.size()) {
+            DIE << name << "(): arrays of different sizes: " << other.size() << " and " << values.size();
+        }
+        return values;
+    }
+
+    static MapObject* mapArg(const EvaValue& value, const char* name) {
+        if (!IS_MAP(value)) {
+            DIE << name << "(): expected a map, got " << value;
+        }
+        return AS_MAP(value);
+    }
+
+    static StringObject* mapKey(const EvaValue& key, const char* name) {
+        if (!IS_STRING(key)) {
+            DIE << name << "(): map keys are strings, got " << key;
+        }
+        return AS_STRING(key);
+    }
+
+    /**
+     * Stores an entry in a map. The map is in the old generation,
+     * so the key and the value escape the execution.
+     */
+    void mapSet(MapObject* map, const EvaValue& key, const EvaValue& value) {
+        auto oldKey = heap.promote(key);
+        auto oldValue = heap.promote(value);
+        heap.writeBarrier(oldKey);
+        heap.writeBarrier(oldValue);
+        map->set(mapKey(oldKey, "put"), oldValue);
+    }
+
+    /**
+     * Calls a closure: its frame starts at the first argument, the
+     * closure itself stays under it (for the upvalues).
+     */
+    void callClosure(ClosureObject* closure, uint8_t argc) {
+        auto callee = closure->code;
+        if (callee->arity != argc) {
+            DIE << "OP_CALL: " << callee->name << " expects " << callee->arity << " arguments, got "
+                << (int)argc;
+        }
+
+        // The profiler reads the frames in its signal handler:
+        // they don't move while it runs.
+        if (frames.size() == frames.capacity()) {
+            EvaProfiler::withoutSamples([&] { frames.reserve(std::max<size_t>(16, 2 * frames.capacity())); });
+        }
+        frames.push_back({ip, bp, co});
+        bp = sp - argc;
+
+        // The stack depth of the callee is known statically (see execForm).
+        if (!stack.commit((bp - stack.begin()) + callee->maxStackDepth)) {
+            DIE << "Stack overflow: " << callee->name << " needs " << callee->maxStackDepth << " slots, "
+                << (stack.end() - bp) << " available.";
+        }
+
+        co = callee;
+        ip = &co->code[0];
+    }
+
+    /**
+     * Closure of the running function (under its frame).
+     */
+    ClosureObject* currentClosure() { return AS_CLOSURE(bp[-1]); }
+
+    /**
+     * Checks the upvalue operand of the current instruction.
+     */
+    void checkUpvalue(uint8_t index) {
+        if (frames.empty() || index >= currentClosure()->upvaluesCount) {
+            DIE << opcodeToString(*(ip - 2)) << ": invalid upvalue index: " << (int)index;
+        }
+    }
+
+    /**
+     * Checks the operands of the current OP_CLOSURE.
+     */
+    void checkClosure() {
+        if (ip[0] >= co->constants.size() || !IS_CODE(co->constants[ip[0]])) {
+            DIE << "OP_CLOSURE: invalid code constant: " << (int)ip[0];
+        }
+        for (size_t i = 0; i < ip[1]; i++) {
+            auto isLocal = ip[2 + 2 * i];
+            auto index = ip[3 + 2 * i];
+            auto isValid = isLocal ? index < sp - bp : !frames.empty() && index < currentClosure()->upvaluesCount;
+            if (!isValid) {
+                DIE << "OP_CLOSURE: invalid captured " << (isLocal ? "local" : "upvalue") << ": " << (int)index;
+            }
+        }
+    }
+
+    /**
+     * Stores into a box. Boxes are in the old generation,
+     * so the value escapes the execution.
+     */
+    void setBoxed(const EvaValue& box, const EvaValue& value) {
+        auto oldValue = heap.promote(value);
+        heap.writeBarrier(oldValue);
+        AS_BOX(box)->value = oldValue;
+    }
+
+    /**
+     * Checks an array index.
+     */
+    static size_t arrayIndex(const std::vector<double>& values, const EvaValue& index) {
+        if (IS_INT(index)) {
+            auto i = AS_INT(index);
+            if (i < 0 || (uint64_t)i >= values.size()) {
+                DIE << "Array index " << i << " out of bounds [0, " << values.size() << ")";
+            }
+            return (size_t)i;
+        }
+        if (!IS_NUMBER(index) || AS_NUMBER(index) != std::floor(AS_NUMBER(index))) {
+            DIE << "Invalid array index: " << index;
+        }
+        auto i = AS_NUMBER(index);
+        if (i < 0 || i >= values.size()) {
+            DIE << "Array index " << i << " out of bounds [0, " << values.size() << ")";
+        }
+        return (size_t)i;
+    }
+
+    /**
+     * Integer value of a switch key: an int, or an integral double.
+     */
+    static bool switchIntKey(const EvaValue& key, int64_t& result) {
+        if (IS_INT(key)) {
+            result = AS_INT(key);
+            return true;
+        }
+        if (IS_NUMBER(key) && AS_NUMBER(key) == std::floor(AS_NUMBER(key)) &&
+            std::abs(AS_NUMBER(key)) < 9.2e18) {
+            result = (int64_t)AS_NUMBER(key);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Checks the switch table operand of the current instruction.
+     */
+    void checkSwitchTable() {
+        if (*ip >= co->switchTables.size()) {
+            DIE << opcodeToString(*(ip - 1)) << ": invalid switch table index: " << (int)*ip;
+        }
+    }
+
+    /**
+     * Target of OP_TABLE_SWITCH: indexed by the key.
+     */
+    static uint16_t tableSwitchTarget(const SwitchTable& table, const EvaValue& key) {
+        int64_t i;
+        if (!switchIntKey(key, i) || i < table.low || (uint64_t)(i - table.low) >= table.targets.size()) {
+            return table.defaultTarget;
+        }
+        return table.targets[i - table.low];
+    }
+
+    /**
+     * Target of OP_LOOKUP_SWITCH: binary search of the key.
+     */
+    static uint16_t lookupSwitchTarget(const SwitchTable& table, const EvaValue& key) {
+        int64_t i;
+        if (switchIntKey(key, i)) {
+            auto it = std::lower_bound(table.intCases.begin(), table.intCases.end(),
+                                       std::make_pair(i, (uint16_t)0));
+            if (it != table.intCases.end() && it->first == i) {
+                return it->second;
+            }
+        } else if (IS_STRING(key)) {
+            auto& string = AS_CPPSTRING(key);
+            auto it = std::lower_bound(table.stringCases.begin(), table.stringCases.end(), string,
+                                       [](const std::pair<std::string, uint16_t>& entry,
+                                          const std::string& string) { return entry.first < string; });
+            if (it != table.stringCases.end() && it->first == string) {
+                return it->second;
+            }
+        }
+        return table.defaultTarget;
+    }
+
+    /**
+     * Returns a number argument of a native function.
+     */
+    static double numberArg(NativeArgs args, size_t index, const char* name) {
+        if (!IS_NUMERIC(args[index])) {
+            DIE << name << "(): expected a number, got " << args[index];
+        }
+        return AS_DOUBLE(args[index]);
     }
 
     /**
@@ -330,7 +1461,7 @@ public:
     /**
      * Instruction pointer (aka Program Counter).
      */
-    uint8_t *ip;
+    uint8_t *ip = nullptr;
 
     /**
      * Stack pointer.
@@ -345,12 +1476,51 @@ public:
     /**
      * Operands stack.
      */
-    std::array<EvaValue, STACK_LIMIT> stack;
+    EvaStack stack;
+
+    /**
+     * Callers of the running closures.
+     */
+    std::vector<Frame> frames;
+
+    /**
+     * Frames count of the innermost call from the host (see call()),
+     * 0 if none: its OP_RETURN leaves the eval loop.
+     */
+    size_t hostFrames = 0;
+
+    /**
+     * Heap of the objects created at runtime. The value returned by
+     * exec() stays valid until the next execution.
+     */
+    EvaHeap heap{{stack.begin(), &sp, global.get()}};
+
+    /**
+     * Instructions until the next incremental GC step.
+     */
+    size_t gcCountdown = GC_STEP_INTERVAL;
 
     /**
      * Code Object;
      */
-    CodeObject *co;
+    CodeObject *co = nullptr;
+
+    /**
+     * Sampling profiler (idle unless started).
+     */
+    EvaProfiler profiler{&ip, &co, &frames};
+
+    /**
+     * Quickening counters.
+     */
+    QuickeningStats quickeningStats;
+
+#ifdef EVA_OPCODE_STATS
+    /**
+     * Instruction counters.
+     */
+    OpcodeCounter opcodeCounter;
+#endif
 };
 
 #endif //RETROSEVAVM_EVAVM_H
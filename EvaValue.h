@@ -5,36 +5,198 @@
 #ifndef RETROSEVAVM_EVAVALUE_H
 #define RETROSEVAVM_EVAVALUE_H
 
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 struct EvaValue;
 
+/**
+ * Value types. NUMBER is a double, INT a 64-bit integer; both are
+ * numbers for the language (see IS_NUMERIC).
+ */
 enum class EvaValueType {
     NUMBER,
     BOOLEAN,
-    OBJECT
+    OBJECT,
+    INT,
 };
 
 enum class ObjectType {
     STRING,
     CODE,
+    NATIVE,
+    ARRAY,
+    MAP,
+    CLOSURE,
+    BOX,
+};
+
+/**
+ * Heap generation of an object (see EvaHeap.h).
+ */
+enum class Generation : uint8_t {
+    /**
+     * Owned by the compiler (constants, code), never collected.
+     */
+    PERMANENT,
+
+    /**
+     * Bump-allocated in the nursery.
+     */
+    YOUNG,
+
+    /**
+     * Survived a minor collection, or escaped.
+     */
+    OLD,
 };
 
 struct Object {
     Object(ObjectType type): type(type) {}
     ObjectType type;
+
+    Generation generation = Generation::PERMANENT;
+
+    /**
+     * Mark bit of the old generation collector.
+     */
+    bool marked = false;
 };
 
 struct StringObject: public Object {
     StringObject(const std::string& str)
         : Object(ObjectType::STRING), string(str) {}
     std::string string;
+
+    /**
+     * Hash of the string (FNV-1a), computed on first use.
+     * Strings are immutable, so it never changes.
+     */
+    uint32_t getHash() {
+        if (hash == 0) {
+            uint32_t h = 2166136261u;
+            for (auto c : string) {
+                h = (h ^ (uint8_t)c) * 16777619u;
+            }
+            // 0 means not computed yet.
+            hash = h == 0 ? 1 : h;
+        }
+        return hash;
+    }
+
+    uint32_t hash = 0;
 };
 
 
+/**
+ * Array of numbers, stored unboxed and contiguously.
+ */
+struct ArrayObject: public Object {
+    ArrayObject(std::vector<double>&& values)
+        : Object(ObjectType::ARRAY), values(std::move(values)) {}
+    std::vector<double> values;
+};
+
 struct LocalVar {
     std::string name;
     size_t scopeLevel;
+
+    /**
+     * Stack slot, from the frame base.
+     */
+    size_t slot;
+
+    /**
+     * Whether the variable is known to hold a number.
+     */
+    bool isNumber = false;
+
+    /**
+     * Whether the variable is known to hold an int
+     * (as long as its math doesn't overflow).
+     */
+    bool isInt = false;
+
+    /**
+     * Whether the slot holds a box (the variable is captured,
+     * and assigned after, see OP_CLOSURE).
+     */
+    bool isBoxed = false;
+};
+
+/**
+ * Variable of an enclosing function captured by a closure:
+ * a local of the function creating the closure, or one of its
+ * upvalues.
+ */
+struct Upvalue {
+    std::string name;
+    bool isLocal;
+
+    /**
+     * Slot of the local, or index of the upvalue.
+     */
+    uint8_t index;
+
+    /**
+     * Whether it's captured as a box.
+     */
+    bool isBoxed;
+};
+
+/**
+ * Runtime type feedback of an instruction.
+ */
+struct InlineCache {
+    /**
+     * Consecutive executions with number operands.
+     */
+    uint8_t hits = 0;
+
+    /**
+     * Times the specialized version failed its type guard.
+     */
+    uint8_t deopts = 0;
+};
+
+/**
+ * Machine code of a code object (see jit/EvaJIT.h).
+ */
+struct JitCode;
+
+/**
+ * Line table entry: the instructions from `offset` up to
+ * the next entry come from source line `line`.
+ */
+struct LineRun {
+    uint32_t offset;
+    uint32_t line;
+};
+
+/**
+ * Jump targets of a switch instruction (bytecode offsets).
+ */
+struct SwitchTable {
+    /**
+     * OP_TABLE_SWITCH: target of the key `low + i`.
+     */
+    int64_t low = 0;
+    std::vector<uint16_t> targets;
+
+    /**
+     * OP_LOOKUP_SWITCH: cases sorted by key.
+     */
+    std::vector<std::pair<int64_t, uint16_t>> intCases;
+    std::vector<std::pair<std::string, uint16_t>> stringCases;
+
+    /**
+     * Target when no case matches.
+     */
+    uint16_t defaultTarget = 0;
 };
 
 struct CodeObject: public Object {
@@ -53,6 +215,60 @@ struct CodeObject: public Object {
      */
     std::vector<uint8_t> code;
 
+    /**
+     * Bytecode as compiled, saved before the first
+     * runtime rewrite (quickening) of `code`.
+     */
+    std::vector<uint8_t> originalCode;
+
+    /**
+     * Inline caches, indexed by instruction offset
+     * (allocated on first use).
+     */
+    std::vector<InlineCache> inlineCaches;
+
+    /**
+     * Loop back-edges taken, and the machine code compiled
+     * once they cross the JIT threshold.
+     */
+    size_t backEdges = 0;
+    std::shared_ptr<JitCode> jitCode;
+
+    /**
+     * Source lines of the bytecode, run-length encoded
+     * (sorted by offset).
+     */
+    std::vector<LineRun> lineTable;
+
+    /**
+     * Jump tables of the switch instructions.
+     */
+    std::vector<SwitchTable> switchTables;
+
+    /**
+     * Maximum depth of the operand stack (relative to
+     * the entry), computed by the compiler.
+     */
+    size_t maxStackDepth = 0;
+
+    /**
+     * Passed the bytecode verifier: runs without
+     * per-instruction checks.
+     */
+    bool verified = false;
+
+    /**
+     * Whether the code is a function body (left by OP_RETURN),
+     * and its number of parameters, the first locals.
+     */
+    bool isFunction = false;
+    size_t arity = 0;
+
+    /**
+     * Variables captured by the closures of the function.
+     */
+    std::vector<Upvalue> upvalues;
+
     /**
      * Current scope level.
      */
@@ -64,10 +280,66 @@ struct CodeObject: public Object {
     std::vector<LocalVar> locals;
 
     /**
-     * Adds a local with current scope level.
+     * Names of the locals declared in each slot, separated by "/"
+     * (the locals are gone after their scopes, e.g. for the disassembler).
+     */
+    std::vector<std::string> localNames;
+
+    /**
+     * Adds a local in the stack slot, with current scope level.
+     */
+    void addLocal(const std::string& name, size_t slot, bool isNumber = false, bool isInt = false,
+                  bool isBoxed = false) {
+        locals.push_back({ name, scopeLevel, slot, isNumber, isInt, isBoxed });
+
+        if (localNames.size() <= slot) {
+            localNames.resize(slot + 1);
+        }
+        auto& names = localNames[slot];
+        if (names.empty()) {
+            names = name;
+        } else if (("/" + names + "/").find("/" + name + "/") == std::string::npos) {
+            names += "/" + name;
+        }
+    }
+
+    /**
+     * Returns the source line of the instruction at offset (0 if unknown).
+     */
+    size_t getLine(size_t offset) const {
+        auto it = std::upper_bound(lineTable.begin(), lineTable.end(), offset,
+                                   [](size_t offset, const LineRun& run) { return offset < run.offset; });
+        return it == lineTable.begin() ? 0 : (it - 1)->line;
+    }
+
+    /**
+     * Returns the inline cache of the instruction at offset.
+     */
+    InlineCache& getInlineCache(size_t offset) {
+        if (inlineCaches.empty()) {
+            inlineCaches.resize(code.size());
+        }
+        return inlineCaches[offset];
+    }
+
+    /**
+     * Rewrites an instruction in place, saving the compiled code first.
+     */
+    void rewriteOpcode(size_t offset, uint8_t opcode) {
+        if (originalCode.empty()) {
+            originalCode = code;
+        }
+        code[offset] = opcode;
+    }
+
+    /**
+     * Restores the compiled bytecode, and drops the type feedback.
      */
-    void addLocal(const std::string& name) {
-        locals.push_back({ name, scopeLevel });
+    void resetQuickening() {
+        if (!originalCode.empty()) {
+            std::copy(originalCode.begin(), originalCode.end(), code.begin());
+        }
+        inlineCaches.clear();
     }
 
     /**
@@ -90,26 +362,276 @@ struct EvaValue {
     EvaValueType type;
     union {
         double number;
+        int64_t integer;
         bool boolean;
         Object* object;
     };
 };
 
+/**
+ * Arguments of a native function call: a view of the operand stack
+ * slots holding them. They are not copied, and are valid only
+ * during the call.
+ */
+struct NativeArgs {
+    const EvaValue* data;
+    size_t count;
+
+    const EvaValue& operator[](size_t index) const { return data[index]; }
+    size_t size() const { return count; }
+    const EvaValue* begin() const { return data; }
+    const EvaValue* end() const { return data + count; }
+};
+
+using NativeFn = std::function<EvaValue(NativeArgs args)>;
+
+/**
+ * Arity of natives accepting any number of arguments.
+ */
+const int VARIADIC = -1;
+
+/**
+ * Host (C++) function.
+ */
+struct NativeObject: public Object {
+    NativeObject(NativeFn function, const std::string& name, int arity)
+        : Object(ObjectType::NATIVE), function(function), name(name), arity(arity) {}
+
+    NativeFn function;
+    std::string name;
+
+    /**
+     * Number of arguments, or VARIADIC.
+     */
+    int arity;
+};
+
+/**
+ * Function value: a code object, and the values of the variables it
+ * captured, copied into a flat array allocated along with the object.
+ */
+struct ClosureObject: public Object {
+    ClosureObject(CodeObject* code, size_t upvaluesCount)
+        : Object(ObjectType::CLOSURE), code(code), upvaluesCount(upvaluesCount) {}
+
+    CodeObject* code;
+    size_t upvaluesCount;
+
+    /**
+     * Upvalues, right after the object.
+     */
+    EvaValue* upvalues() { return reinterpret_cast<EvaValue*>(this + 1); }
+
+    /**
+     * Size of a closure with `upvaluesCount` upvalues.
+     */
+    static size_t sizeFor(size_t upvaluesCount) {
+        return sizeof(ClosureObject) + upvaluesCount * sizeof(EvaValue);
+    }
+};
+
+static_assert(sizeof(ClosureObject) % alignof(EvaValue) == 0, "upvalues follow the closure");
+
+/**
+ * Caller of a running closure, restored by OP_RETURN.
+ */
+struct Frame {
+    uint8_t* ip;
+    EvaValue* bp;
+    CodeObject* co;
+};
+
+/**
+ * Variable shared by a function and its closures: captured
+ * variables that are assigned after the capture live in a box.
+ */
+struct BoxObject: public Object {
+    BoxObject(const EvaValue& value) : Object(ObjectType::BOX), value(value) {}
+    EvaValue value;
+};
+
+/**
+ * Slot of a map table. An empty slot has hash 0.
+ */
+struct MapSlot {
+    StringObject* key = nullptr;
+    uint32_t hash = 0;
+
+    /**
+     * Distance from the slot the hash maps to.
+     */
+    uint32_t distance = 0;
+
+    EvaValue value;
+};
+
+/**
+ * Map from strings to values.
+ *
+ * Open addressing with linear probing and Robin Hood displacement: an
+ * entry being inserted takes the slot of any entry closer to its home
+ * slot, which keeps the probe lengths short and even at high load, and
+ * lets a lookup stop at the first entry closer to home than itself.
+ * Deletion shifts the following entries back (no tombstones). The
+ * entries live inline in one array, and the cached key hashes are
+ * compared before the strings.
+ *
+ * The table doubles above 7/8 load, and halves below 1/8.
+ */
+struct MapObject: public Object {
+    MapObject() : Object(ObjectType::MAP) {}
+
+    /**
+     * Returns the value of the key, or nullptr.
+     */
+    EvaValue* find(StringObject* key) {
+        auto index = findIndex(key);
+        return index == NOT_FOUND ? nullptr : &slots[index].value;
+    }
+
+    /**
+     * Sets the value of a key (added if missing).
+     */
+    void set(StringObject* key, const EvaValue& value) {
+        auto existing = find(key);
+        if (existing != nullptr) {
+            *existing = value;
+            return;
+        }
+        if ((count + 1) * 8 > slots.size() * 7) {
+            resize(std::max(MIN_CAPACITY, slots.size() * 2));
+        }
+        insert({key, key->getHash(), 0, value});
+        count++;
+    }
+
+    /**
+     * Removes a key. Returns whether it was present.
+     */
+    bool remove(StringObject* key) {
+        auto index = findIndex(key);
+        if (index == NOT_FOUND) {
+            return false;
+        }
+
+        // Shift back the following entries displaced from their home.
+        auto mask = slots.size() - 1;
+        auto next = (index + 1) & mask;
+        while (slots[next].hash != 0 && slots[next].distance > 0) {
+            slots[index] = slots[next];
+            slots[index].distance--;
+            index = next;
+            next = (next + 1) & mask;
+        }
+        slots[index] = MapSlot{};
+        count--;
+
+        if (slots.size() > MIN_CAPACITY && count * 8 < slots.size()) {
+            resize(slots.size() / 2);
+        }
+        return true;
+    }
+
+    size_t size() const { return count; }
+
+    /**
+     * Calls fn(key, value) for every entry.
+     */
+    template <typename Fn>
+    void forEach(Fn fn) {
+        for (auto& slot : slots) {
+            if (slot.hash != 0) {
+                fn(slot.key, slot.value);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t MIN_CAPACITY = 8;
+    static constexpr size_t NOT_FOUND = (size_t)-1;
+
+    size_t findIndex(StringObject* key) {
+        if (count == 0) {
+            return NOT_FOUND;
+        }
+        auto hash = key->getHash();
+        auto mask = slots.size() - 1;
+        auto index = hash & mask;
+
+        for (uint32_t distance = 0;; distance++) {
+            auto& slot = slots[index];
+            if (slot.hash == 0 || slot.distance < distance) {
+                return NOT_FOUND;
+            }
+            if (slot.hash == hash && (slot.key == key || slot.key->string == key->string)) {
+                return index;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    void insert(MapSlot entry) {
+        auto mask = slots.size() - 1;
+        auto index = entry.hash & mask;
+
+        for (;;) {
+            auto& slot = slots[index];
+            if (slot.hash == 0) {
+                slot = entry;
+                return;
+            }
+            // Robin Hood: the entry further from home takes the slot.
+            if (slot.distance < entry.distance) {
+                std::swap(slot, entry);
+            }
+            index = (index + 1) & mask;
+            entry.distance++;
+        }
+    }
+
+    void resize(size_t capacity) {
+        std::vector<MapSlot> old(capacity);
+        old.swap(slots);
+        for (auto& slot : old) {
+            if (slot.hash != 0) {
+                slot.distance = 0;
+                insert(slot);
+            }
+        }
+    }
+
+    /**
+     * Power of two number of slots.
+     */
+    std::vector<MapSlot> slots;
+    size_t count = 0;
+};
+
 // ------------------------------------------------------------
 // Constructors:
 
 #define NUMBER(value) ((EvaValue){EvaValueType::NUMBER, .number = value})
 #define BOOLEAN(value) ((EvaValue){EvaValueType::BOOLEAN, .boolean = value})
+#define INT(value) ((EvaValue){EvaValueType::INT, .integer = (int64_t)(value)})
 
 #define ALLOC_STRING(value) ((EvaValue){EvaValueType::OBJECT, .object = new StringObject(value)})
 
 #define ALLOC_CODE(name) ((EvaValue){EvaValueType::OBJECT, .object = new CodeObject(name)})
 
+#define ALLOC_NATIVE(fn, name, arity) \
+    ((EvaValue){EvaValueType::OBJECT, .object = new NativeObject(fn, name, arity)})
+
 
 // ------------------------------------------------------------
 // Accessors:
 #define AS_NUMBER(evaValue) ((double)(evaValue).number)
 #define AS_BOOLEAN(evaValue) ((bool)(evaValue).boolean)
+#define AS_INT(evaValue) ((int64_t)(evaValue).integer)
+
+/**
+ * Value of a number (int or double) as a double.
+ */
+#define AS_DOUBLE(evaValue) (IS_INT(evaValue) ? (double)(evaValue).integer : (evaValue).number)
 #define AS_OBJECT(evaValue) ((Object*)(evaValue).object)
 
 #define AS_STRING(evaValue) ((StringObject*)(evaValue).object)
@@ -117,12 +639,34 @@ struct EvaValue {
 
 #define AS_CODE(evaValue) ((CodeObject*)(evaValue).object)
 
+#define AS_NATIVE(evaValue) ((NativeObject*)(evaValue).object)
+
+#define AS_ARRAY(evaValue) ((ArrayObject*)(evaValue).object)
+
+#define AS_MAP(evaValue) ((MapObject*)(evaValue).object)
+
+#define AS_CLOSURE(evaValue) ((ClosureObject*)(evaValue).object)
+
+#define AS_BOX(evaValue) ((BoxObject*)(evaValue).object)
+
 
 // ------------------------------------------------------------
 // Testers:
 #define IS_NUMBER(evaValue) ((evaValue).type == EvaValueType::NUMBER)
 #define IS_BOOLEAN(evaValue) ((evaValue).type == EvaValueType::BOOLEAN)
 #define IS_OBJECT(evaValue) ((evaValue).type == EvaValueType::OBJECT)
+#define IS_INT(evaValue) ((evaValue).type == EvaValueType::INT)
+
+/**
+ * Int or double.
+ */
+#define IS_NUMERIC(evaValue) (IS_NUMBER(evaValue) || IS_INT(evaValue))
+
+/**
+ * Truthiness of a condition (if, while, and, or, not):
+ * false is the only falsy value, any other one is true.
+ */
+#define IS_FALSY(evaValue) (IS_BOOLEAN(evaValue) && !AS_BOOLEAN(evaValue))
 
 #define IS_OBJECT_TYPE(evaValue, objectType) \
     (IS_OBJECT(evaValue) && AS_OBJECT(evaValue)->type == objectType)
@@ -131,15 +675,37 @@ struct EvaValue {
 
 #define IS_CODE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CODE)
 
+#define IS_NATIVE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::NATIVE)
+
+#define IS_ARRAY(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::ARRAY)
+
+#define IS_MAP(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::MAP)
+
+#define IS_CLOSURE(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::CLOSURE)
+
+#define IS_BOX(evaValue) IS_OBJECT_TYPE(evaValue, ObjectType::BOX)
+
 std::string evaValueToTypeString(const EvaValue& evaValue) {
     if (IS_NUMBER(evaValue)) {
         return "NUMBER";
+    } else if (IS_INT(evaValue)) {
+        return "INT";
     } else if (IS_BOOLEAN(evaValue)) {
         return "BOOLEAN";
     } else if (IS_STRING(evaValue)) {
         return "STRING";
     } else if (IS_CODE(evaValue)) {
         return "CODE";
+    } else if (IS_NATIVE(evaValue)) {
+        return "NATIVE";
+    } else if (IS_ARRAY(evaValue)) {
+        return "ARRAY";
+    } else if (IS_MAP(evaValue)) {
+        return "MAP";
+    } else if (IS_CLOSURE(evaValue)) {
+        return "CLOSURE";
+    } else if (IS_BOX(evaValue)) {
+        return "BOX";
     } else {
         DIE << "evaValueToTypeString: unknown type " << (int)evaValue.type;
     }
@@ -150,6 +716,8 @@ std::string evaValueToConstantString(const EvaValue& evaValue) {
     std::stringstream ss;
     if (IS_NUMBER(evaValue)) {
         ss << evaValue.number;
+    } else if (IS_INT(evaValue)) {
+        ss << evaValue.integer;
     } else if (IS_BOOLEAN(evaValue)) {
         ss << (evaValue.boolean ? "true" : "false");
     } else if (IS_STRING(evaValue)) {
@@ -157,6 +725,27 @@ std::string evaValueToConstantString(const EvaValue& evaValue) {
     } else if (IS_CODE(evaValue)) {
         auto code = AS_CODE(evaValue);
         ss << "code " << code << ": " << code->name;
+    } else if (IS_NATIVE(evaValue)) {
+        auto native = AS_NATIVE(evaValue);
+        ss << native->name << "/" << native->arity;
+    } else if (IS_ARRAY(evaValue)) {
+        auto& values = AS_ARRAY(evaValue)->values;
+        ss << "[";
+        for (size_t i = 0; i < values.size(); i++) {
+            if (i == 8) {
+                ss << ", ... (" << values.size() << " items)";
+                break;
+            }
+            ss << (i > 0 ? ", " : "") << values[i];
+        }
+        ss << "]";
+    } else if (IS_MAP(evaValue)) {
+        ss << "map (" << AS_MAP(evaValue)->size() << " entries)";
+    } else if (IS_CLOSURE(evaValue)) {
+        auto code = AS_CLOSURE(evaValue)->code;
+        ss << code->name << "/" << code->arity;
+    } else if (IS_BOX(evaValue)) {
+        ss << "box " << evaValueToConstantString(AS_BOX(evaValue)->value);
     } else {
         DIE << "evaValueToConstantString: unknown type " << (int)evaValue.type;
     }
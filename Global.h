@@ -12,6 +12,11 @@
 struct GlobalVar {
     std::string name;
     EvaValue value;
+
+    /**
+     * Immutable: the compiler substitutes the value.
+     */
+    bool isConst = false;
 };
 
 /**
@@ -51,13 +56,23 @@ struct Global {
 
 
     /**
-     * Adds a global constant.
+     * Adds a global constant (a number or a boolean).
+     */
+    void addConst(const std::string& name, const EvaValue& value) {
+        if (exists(name)) {
+            return;
+        }
+        globals.push_back({ name, value, true });
+    }
+
+    /**
+     * Adds a native function.
      */
-    void addConst(const std::string& name, double value) {
+    void addNativeFunction(const std::string& name, NativeFn fn, int arity) {
         if (exists(name)) {
             return;
         }
-        globals.push_back({ name, NUMBER(value) });
+        globals.push_back({ name, ALLOC_NATIVE(fn, name, arity) });
     }
 
     /**
@@ -0,0 +1,77 @@
+//
+// Created by Retros on 2023/3/5.
+//
+
+#ifndef RETROSEVAVM_MAPPEDFILE_H
+#define RETROSEVAVM_MAPPEDFILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "Logger.h"
+
+/**
+ * Read-only memory mapping of a source file.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            DIE << "MappedFile: cannot open " << path << ": " << std::strerror(errno);
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            ::close(fd);
+            DIE << "MappedFile: cannot stat " << path << ": " << std::strerror(errno);
+        }
+
+        size = (size_t)st.st_size;
+
+        // Zero-length mappings are not allowed.
+        if (size > 0) {
+            auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                DIE << "MappedFile: cannot map " << path << ": " << std::strerror(errno);
+            }
+            data = (const char*)addr;
+
+            // Sources are scanned front to back once.
+            ::madvise(addr, size, MADV_SEQUENTIAL);
+        }
+
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            ::munmap((void*)data, size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * Mapped contents.
+     */
+    std::string_view view() const { return {data, size}; }
+
+private:
+    /**
+     * Mapped region.
+     */
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+#endif //RETROSEVAVM_MAPPEDFILE_H
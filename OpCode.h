@@ -65,6 +65,117 @@
  */
 #define OP_SCOPE_EXIT 0x14
 
+/**
+ * Number-specialized arithmetic and comparison, emitted when
+ * both operands are known to be numbers. The operand types are
+ * still guarded: on a mismatch the instruction is rewritten to
+ * its generic version, which then handles it.
+ */
+#define OP_ADD_NUM 0x15
+#define OP_SUB_NUM 0x16
+#define OP_MUL_NUM 0x17
+#define OP_DIV_NUM 0x18
+#define OP_COMPARE_NUM 0x19
+
+/**
+ * Calls a function (native, or a closure) with the given number
+ * of arguments: <fn> <arg1> ... <argN> -> <result>
+ * A closure runs in a new frame, based at its first argument.
+ */
+#define OP_CALL 0x1A
+
+/**
+ * Creates an array of the given number of values from the stack.
+ */
+#define OP_ARRAY 0x1B
+
+/**
+ * Array element access:
+ * <array> <index> -> <value>
+ * <array> <index> <value> -> <value>
+ */
+#define OP_GET_INDEX 0x1C
+#define OP_SET_INDEX 0x1D
+
+/**
+ * Creates a map of the given number of key/value pairs from the stack.
+ */
+#define OP_MAP 0x1E
+
+/**
+ * Map key test and removal:
+ * <map> <key> -> <boolean>
+ */
+#define OP_HAS_KEY 0x1F
+#define OP_DELETE_KEY 0x20
+
+/**
+ * Multiway branch on the key popped from the stack, through the
+ * switch table of the given index (see SwitchTable): indexed by
+ * the key for dense int keys, or searched for sparse and string keys.
+ */
+#define OP_TABLE_SWITCH 0x21
+#define OP_LOOKUP_SWITCH 0x22
+
+/**
+ * Back-edge of a counted loop: adds the step to the counter (a local,
+ * followed by the end and the step locals), and jumps to the address
+ * while the counter is less than the end.
+ * <local> <2-byte address>
+ */
+#define OP_LOOP_INC_LT 0x23
+
+/**
+ * Control flow: jump if the value on the stack is true.
+ */
+#define OP_JMP_IF_TRUE 0x24
+
+/**
+ * Pushes an int given as a signed 1-byte or 2-byte immediate operand,
+ * without going through the constant pool.
+ */
+#define OP_PUSH_SMALLINT8 0x25
+#define OP_PUSH_SMALLINT16 0x26
+
+/**
+ * Pushes a boolean.
+ */
+#define OP_PUSH_TRUE 0x27
+#define OP_PUSH_FALSE 0x28
+
+/**
+ * Returns from a closure: pops its frame (the callee and the
+ * arguments), and pushes the result.
+ */
+#define OP_RETURN 0x29
+
+/**
+ * Creates a closure of the code object (a constant) with the
+ * given number of upvalues, copied from the locals or the upvalues
+ * of the current closure:
+ * <const> <count> (<isLocal> <index>){count}
+ */
+#define OP_CLOSURE 0x2A
+
+/**
+ * Upvalue access of the current closure. Upvalues that are
+ * assigned hold a box, which is read and written through.
+ */
+#define OP_GET_UPVALUE 0x2B
+#define OP_SET_UPVALUE 0x2C
+
+/**
+ * Wraps the value on the stack into a box (of a variable
+ * captured and assigned, see OP_CLOSURE).
+ */
+#define OP_BOX 0x2D
+
+/**
+ * Access of a local holding a box.
+ */
+#define OP_GET_BOXED 0x2E
+#define OP_SET_BOXED 0x2F
+
 // -----------------------------------------------------------
 
 #define OP_STR(op) \
@@ -88,6 +199,33 @@ std::string opcodeToString(uint8_t opcode) {
         OP_STR(GET_LOCAL);
         OP_STR(SET_LOCAL);
         OP_STR(SCOPE_EXIT);
+        OP_STR(ADD_NUM);
+        OP_STR(SUB_NUM);
+        OP_STR(MUL_NUM);
+        OP_STR(DIV_NUM);
+        OP_STR(COMPARE_NUM);
+        OP_STR(CALL);
+        OP_STR(ARRAY);
+        OP_STR(GET_INDEX);
+        OP_STR(SET_INDEX);
+        OP_STR(MAP);
+        OP_STR(HAS_KEY);
+        OP_STR(DELETE_KEY);
+        OP_STR(TABLE_SWITCH);
+        OP_STR(LOOKUP_SWITCH);
+        OP_STR(LOOP_INC_LT);
+        OP_STR(JMP_IF_TRUE);
+        OP_STR(PUSH_SMALLINT8);
+        OP_STR(PUSH_SMALLINT16);
+        OP_STR(PUSH_TRUE);
+        OP_STR(PUSH_FALSE);
+        OP_STR(RETURN);
+        OP_STR(CLOSURE);
+        OP_STR(GET_UPVALUE);
+        OP_STR(SET_UPVALUE);
+        OP_STR(BOX);
+        OP_STR(GET_BOXED);
+        OP_STR(SET_BOXED);
         default: {
             DIE << "opcodeToString: unknown opcode: " << (int) opcode;
         }
@@ -95,4 +233,194 @@ std::string opcodeToString(uint8_t opcode) {
     }
 }
 
+/**
+ * Whether the byte is an opcode of the instruction set.
+ */
+bool isValidOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_HALT:
+        case OP_CONST:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_COMPARE:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SCOPE_EXIT:
+        case OP_ADD_NUM:
+        case OP_SUB_NUM:
+        case OP_MUL_NUM:
+        case OP_DIV_NUM:
+        case OP_COMPARE_NUM:
+        case OP_CALL:
+        case OP_ARRAY:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+        case OP_MAP:
+        case OP_HAS_KEY:
+        case OP_DELETE_KEY:
+        case OP_TABLE_SWITCH:
+        case OP_LOOKUP_SWITCH:
+        case OP_LOOP_INC_LT:
+        case OP_JMP_IF_TRUE:
+        case OP_PUSH_SMALLINT8:
+        case OP_PUSH_SMALLINT16:
+        case OP_PUSH_TRUE:
+        case OP_PUSH_FALSE:
+        case OP_RETURN:
+        case OP_CLOSURE:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_BOX:
+        case OP_GET_BOXED:
+        case OP_SET_BOXED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Size in bytes of the instruction (opcode and operands).
+ */
+size_t instructionSize(const uint8_t* instruction) {
+    switch (*instruction) {
+        case OP_CONST:
+        case OP_COMPARE:
+        case OP_COMPARE_NUM:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SCOPE_EXIT:
+        case OP_CALL:
+        case OP_ARRAY:
+        case OP_MAP:
+        case OP_TABLE_SWITCH:
+        case OP_LOOKUP_SWITCH:
+        case OP_PUSH_SMALLINT8:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_BOXED:
+        case OP_SET_BOXED:
+            return 2;
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_TRUE:
+        case OP_JMP:
+        case OP_PUSH_SMALLINT16:
+            return 3;
+        case OP_LOOP_INC_LT:
+            return 4;
+        case OP_CLOSURE:
+            return 3 + 2 * (size_t)instruction[2];
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Net number of values the instruction pushes
+ * onto (positive) or pops from (negative) the stack.
+ */
+int stackEffect(const uint8_t* instruction) {
+    switch (*instruction) {
+        case OP_CONST:
+        case OP_PUSH_SMALLINT8:
+        case OP_PUSH_SMALLINT16:
+        case OP_PUSH_TRUE:
+        case OP_PUSH_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_CLOSURE:
+        case OP_GET_UPVALUE:
+        case OP_GET_BOXED:
+            return 1;
+        case OP_HALT:
+        case OP_RETURN:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_ADD_NUM:
+        case OP_SUB_NUM:
+        case OP_MUL_NUM:
+        case OP_DIV_NUM:
+        case OP_COMPARE:
+        case OP_COMPARE_NUM:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_TRUE:
+        case OP_POP:
+        case OP_GET_INDEX:
+        case OP_HAS_KEY:
+        case OP_DELETE_KEY:
+        case OP_TABLE_SWITCH:
+        case OP_LOOKUP_SWITCH:
+            return -1;
+        case OP_SET_INDEX:
+            return -2;
+        case OP_ARRAY:
+            return 1 - (int)instruction[1];
+        case OP_MAP:
+            return 1 - 2 * (int)instruction[1];
+        case OP_SCOPE_EXIT:
+        case OP_CALL:
+            return -(int)instruction[1];
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Number of values the instruction reads from the top of
+ * the stack (popped, or peeked like the stored value of SET_LOCAL).
+ */
+int stackInputs(const uint8_t* instruction) {
+    switch (*instruction) {
+        case OP_HALT:
+        case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_TRUE:
+        case OP_POP:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_TABLE_SWITCH:
+        case OP_LOOKUP_SWITCH:
+        case OP_RETURN:
+        case OP_SET_UPVALUE:
+        case OP_BOX:
+        case OP_SET_BOXED:
+            return 1;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_ADD_NUM:
+        case OP_SUB_NUM:
+        case OP_MUL_NUM:
+        case OP_DIV_NUM:
+        case OP_COMPARE:
+        case OP_COMPARE_NUM:
+        case OP_GET_INDEX:
+        case OP_HAS_KEY:
+        case OP_DELETE_KEY:
+            return 2;
+        case OP_SET_INDEX:
+            return 3;
+        case OP_ARRAY:
+            return instruction[1];
+        case OP_MAP:
+            return 2 * (int)instruction[1];
+        case OP_SCOPE_EXIT:
+        case OP_CALL:
+            return instruction[1] + 1;
+        default:
+            return 0;
+    }
+}
+
 #endif //RETROSEVAVM_OPCODE_H
@@ -0,0 +1,564 @@
+//
+// Created by Retros on 2023/5/3.
+//
+
+#ifndef RETROSEVAVM_EVACFG_H
+#define RETROSEVAVM_EVACFG_H
+
+#include "../OpCode.h"
+#include "../EvaValue.h"
+#include "../Logger.h"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * Index of a basic block in the graph.
+ */
+using BlockId = size_t;
+
+const BlockId NO_BLOCK = (BlockId)-1;
+
+/**
+ * A decoded instruction.
+ */
+struct CfgInstruction {
+    /**
+     * Opcode and operands, as encoded. The address of a jump
+     * is re-encoded from `target`.
+     */
+    std::vector<uint8_t> bytes;
+
+    /**
+     * Target block of a jump (JMP, JMP_IF_*, LOOP_INC_LT).
+     */
+    BlockId target = NO_BLOCK;
+
+    /**
+     * Source line.
+     */
+    uint32_t line = 0;
+
+    /**
+     * Stack depth before the instruction, -1 if unreachable.
+     */
+    int depth = -1;
+
+    uint8_t opcode() const { return bytes[0]; }
+};
+
+/**
+ * Straight-line code: entered at the first instruction,
+ * left after the last one.
+ */
+struct BasicBlock {
+    std::vector<CfgInstruction> instructions;
+
+    std::vector<BlockId> successors;
+    std::vector<BlockId> predecessors;
+
+    /**
+     * Stack depth on entry, -1 if unreachable.
+     */
+    int entryDepth = -1;
+
+    bool isReachable() const { return entryDepth != -1; }
+};
+
+/**
+ * Control-flow graph of a code object.
+ *
+ * The blocks are in the order of the code: a block without a jump,
+ * switch, HALT or RETURN at its end falls through to the next one (it may
+ * be empty after a transformation). Jumps and switch tables refer to
+ * blocks, so instructions can be removed and the code re-encoded
+ * with the addresses fixed up.
+ */
+class ControlFlowGraph {
+public:
+    /**
+     * Decodes the code object (which must be well-formed, see EvaVerifier).
+     */
+    explicit ControlFlowGraph(const CodeObject* co)
+        : switchTables(co->switchTables), entryDepth((int)co->arity) {
+        decode(co);
+        analyze();
+    }
+
+    /**
+     * Computes the edges, and the stack depth of every reachable
+     * instruction. Must be called again after changes to the control flow.
+     */
+    void analyze() {
+        for (auto& block : blocks) {
+            block.successors.clear();
+            block.predecessors.clear();
+            block.entryDepth = -1;
+            for (auto& instruction : block.instructions) {
+                instruction.depth = -1;
+            }
+        }
+
+        for (BlockId id = 0; id < blocks.size(); id++) {
+            for (auto successor : findSuccessors(id)) {
+                auto& successors = blocks[id].successors;
+                if (std::find(successors.begin(), successors.end(), successor) == successors.end()) {
+                    successors.push_back(successor);
+                    blocks[successor].predecessors.push_back(id);
+                }
+            }
+        }
+
+        // A function starts with its arguments.
+        maxDepth = entryDepth;
+        blocks[0].entryDepth = entryDepth;
+        std::vector<BlockId> worklist = {0};
+
+        while (!worklist.empty()) {
+            auto& block = blocks[worklist.back()];
+            worklist.pop_back();
+
+            auto depth = block.entryDepth;
+            for (auto& instruction : block.instructions) {
+                instruction.depth = depth;
+                depth += stackEffect(instruction.bytes.data());
+                maxDepth = std::max(maxDepth, (size_t)depth);
+            }
+
+            for (auto successor : block.successors) {
+                if (blocks[successor].entryDepth == -1) {
+                    blocks[successor].entryDepth = depth;
+                    worklist.push_back(successor);
+                }
+            }
+        }
+    }
+
+    /**
+     * Keeps only the blocks marked in `keep`. The removed ones must be
+     * unreachable or empty: the jumps to an empty block go to the next
+     * kept one.
+     */
+    void removeBlocks(const std::vector<bool>& keep) {
+        std::vector<BlockId> newIds(blocks.size(), NO_BLOCK);
+        std::vector<BasicBlock> kept;
+        for (BlockId id = 0; id < blocks.size(); id++) {
+            if (keep[id]) {
+                newIds[id] = kept.size();
+                kept.push_back(std::move(blocks[id]));
+            }
+        }
+        blocks = std::move(kept);
+
+        // A removed block continues at the next kept one.
+        for (auto id = newIds.size(); id-- > 0;) {
+            if (!keep[id] && id + 1 < newIds.size()) {
+                newIds[id] = newIds[id + 1];
+            }
+        }
+
+        for (auto& block : blocks) {
+            for (auto& instruction : block.instructions) {
+                if (instruction.target != NO_BLOCK) {
+                    instruction.target = newIds[instruction.target];
+                }
+            }
+        }
+
+        // Tables of removed switches may point to removed blocks,
+        // they are dropped by encode().
+        for (auto& table : switchTables) {
+            forEachTarget(table, [&](uint16_t& target) {
+                target = target == (uint16_t)NO_BLOCK ? target : (uint16_t)newIds[target];
+            });
+        }
+
+        analyze();
+    }
+
+    /**
+     * Whether the control continues to the next block
+     * after the last instruction of the block.
+     */
+    bool fallsThrough(BlockId id) const {
+        auto& instructions = blocks[id].instructions;
+        return instructions.empty() || !endsBlock(instructions.back().opcode());
+    }
+
+    /**
+     * Whether the instruction transfers the control (a jump, a switch,
+     * HALT or RETURN), i.e. ends a block.
+     */
+    static bool endsBlock(uint8_t opcode) {
+        switch (opcode) {
+            case OP_HALT:
+            case OP_RETURN:
+            case OP_JMP:
+            case OP_JMP_IF_FALSE:
+            case OP_JMP_IF_TRUE:
+            case OP_LOOP_INC_LT:
+            case OP_TABLE_SWITCH:
+            case OP_LOOKUP_SWITCH:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Size of the encoded code in bytes.
+     */
+    size_t codeSize() const {
+        size_t size = 0;
+        for (auto& block : blocks) {
+            for (auto& instruction : block.instructions) {
+                size += instruction.bytes.size();
+            }
+        }
+        return size;
+    }
+
+    /**
+     * Re-encodes the graph into the code object: the code, its
+     * line table and switch tables. The type feedback of the
+     * previous code is dropped.
+     */
+    void encode(CodeObject* co) const {
+        std::vector<size_t> offsets(blocks.size());
+        size_t offset = 0;
+        for (BlockId id = 0; id < blocks.size(); id++) {
+            offsets[id] = offset;
+            for (auto& instruction : blocks[id].instructions) {
+                offset += instruction.bytes.size();
+            }
+        }
+
+        std::vector<uint8_t> code;
+        std::vector<LineRun> lineTable;
+        std::vector<SwitchTable> tables;
+        std::vector<int> tableIndexes(switchTables.size(), -1);
+
+        for (auto& block : blocks) {
+            for (auto& instruction : block.instructions) {
+                if (lineTable.empty() || lineTable.back().line != instruction.line) {
+                    lineTable.push_back({(uint32_t)code.size(), instruction.line});
+                }
+
+                auto bytes = instruction.bytes;
+                switch (instruction.opcode()) {
+                    case OP_JMP:
+                    case OP_JMP_IF_FALSE:
+                    case OP_JMP_IF_TRUE:
+                        writeAddress(bytes, 1, offsets[instruction.target]);
+                        break;
+                    case OP_LOOP_INC_LT:
+                        writeAddress(bytes, 2, offsets[instruction.target]);
+                        break;
+                    case OP_TABLE_SWITCH:
+                    case OP_LOOKUP_SWITCH: {
+                        // Tables are renumbered in the order of use.
+                        auto& index = tableIndexes[bytes[1]];
+                        if (index == -1) {
+                            index = tables.size();
+                            tables.push_back(switchTables[bytes[1]]);
+                            forEachTarget(tables.back(),
+                                          [&](uint16_t& target) { target = (uint16_t)offsets[target]; });
+                        }
+                        bytes[1] = (uint8_t)index;
+                        break;
+                    }
+                }
+                code.insert(code.end(), bytes.begin(), bytes.end());
+            }
+        }
+
+        co->code = std::move(code);
+        co->lineTable = std::move(lineTable);
+        co->switchTables = std::move(tables);
+        co->originalCode.clear();
+        co->inlineCaches.clear();
+    }
+
+    /**
+     * Blocks in code order, the entry first.
+     */
+    std::vector<BasicBlock> blocks;
+
+    /**
+     * Switch tables of the code object, with block targets.
+     */
+    std::vector<SwitchTable> switchTables;
+
+    /**
+     * Maximum stack depth of the reachable code.
+     */
+    size_t maxDepth = 0;
+
+private:
+    /**
+     * Stack depth on entry: the arguments of a function.
+     */
+    int entryDepth;
+
+    /**
+     * Splits the code into blocks at the jump targets, and after
+     * the instructions that branch.
+     */
+    void decode(const CodeObject* co) {
+        auto& code = co->code;
+
+        // Block starting at each offset (leaders), NO_BLOCK otherwise.
+        std::vector<BlockId> blockAt(code.size() + 1, NO_BLOCK);
+        auto leader = [&](size_t offset) { blockAt[offset] = 0; };
+
+        leader(0);
+        for (size_t offset = 0; offset < code.size(); offset += instructionSize(&code[offset])) {
+            auto instruction = &code[offset];
+            auto next = offset + instructionSize(instruction);
+            if (next > code.size()) {
+                DIE << "[ControlFlowGraph]: truncated " << opcodeToString(*instruction) << " at " << offset;
+            }
+            switch (*instruction) {
+                case OP_JMP:
+                case OP_JMP_IF_FALSE:
+                case OP_JMP_IF_TRUE:
+                    leader(readAddress(code, offset + 1));
+                    break;
+                case OP_LOOP_INC_LT:
+                    leader(readAddress(code, offset + 2));
+                    break;
+                case OP_TABLE_SWITCH:
+                case OP_LOOKUP_SWITCH:
+                    forEachTarget(co->switchTables[instruction[1]], [&](uint16_t& target) { leader(target); });
+                    break;
+            }
+            if (endsBlock(*instruction)) {
+                leader(next);
+            }
+        }
+
+        for (size_t offset = 0; offset < code.size(); offset++) {
+            if (blockAt[offset] != NO_BLOCK) {
+                blockAt[offset] = blocks.size();
+                blocks.emplace_back();
+            }
+        }
+
+        BlockId current = 0;
+        for (size_t offset = 0; offset < code.size(); offset += instructionSize(&code[offset])) {
+            if (blockAt[offset] != NO_BLOCK) {
+                current = blockAt[offset];
+            }
+
+            CfgInstruction instruction;
+            instruction.bytes.assign(code.begin() + offset, code.begin() + offset + instructionSize(&code[offset]));
+            instruction.line = (uint32_t)co->getLine(offset);
+            switch (instruction.opcode()) {
+                case OP_JMP:
+                case OP_JMP_IF_FALSE:
+                case OP_JMP_IF_TRUE:
+                    instruction.target = blockAt[readAddress(code, offset + 1)];
+                    break;
+                case OP_LOOP_INC_LT:
+                    instruction.target = blockAt[readAddress(code, offset + 2)];
+                    break;
+            }
+            blocks[current].instructions.push_back(std::move(instruction));
+        }
+
+        for (auto& table : switchTables) {
+            forEachTarget(table, [&](uint16_t& target) { target = (uint16_t)blockAt[target]; });
+        }
+    }
+
+    /**
+     * Successors of a block, from its last instruction.
+     */
+    std::vector<BlockId> findSuccessors(BlockId id) const {
+        auto& instructions = blocks[id].instructions;
+        auto fallThrough = id + 1;
+
+        if (fallsThrough(id)) {
+            // An empty block may be left at the end by a transformation.
+            if (fallThrough == blocks.size()) {
+                return {};
+            }
+            return {fallThrough};
+        }
+
+        auto& last = instructions.back();
+        switch (last.opcode()) {
+            case OP_HALT:
+            case OP_RETURN:
+                return {};
+            case OP_JMP:
+                return {last.target};
+            case OP_JMP_IF_FALSE:
+            case OP_JMP_IF_TRUE:
+            case OP_LOOP_INC_LT:
+                return {last.target, fallThrough};
+            default: {
+                // Switch.
+                std::vector<BlockId> targets;
+                forEachTarget(switchTables[last.bytes[1]], [&](uint16_t& target) { targets.push_back(target); });
+                return targets;
+            }
+        }
+    }
+
+    /**
+     * Calls `fn` with a reference to each target of the table.
+     */
+    template <typename Fn>
+    static void forEachTarget(SwitchTable& table, Fn fn) {
+        for (auto& target : table.targets) {
+            fn(target);
+        }
+        for (auto& entry : table.intCases) {
+            fn(entry.second);
+        }
+        for (auto& entry : table.stringCases) {
+            fn(entry.second);
+        }
+        fn(table.defaultTarget);
+    }
+
+    template <typename Fn>
+    static void forEachTarget(const SwitchTable& table, Fn fn) {
+        auto copy = table;
+        forEachTarget(copy, fn);
+    }
+
+    static uint16_t readAddress(const std::vector<uint8_t>& code, size_t offset) {
+        return (uint16_t)((code[offset] << 8) | code[offset + 1]);
+    }
+
+    static void writeAddress(std::vector<uint8_t>& bytes, size_t offset, size_t address) {
+        bytes[offset] = (address >> 8) & 0xff;
+        bytes[offset + 1] = address & 0xff;
+    }
+};
+
+// ------------------------------------------------------------
+// Liveness of stack slots:
+
+/**
+ * Local variables are stack slots (relative to the frame base), and
+ * so are the temporaries: liveness is computed for every slot. A slot
+ * is live if its value may be read before it's written again.
+ */
+using LiveSlots = std::vector<bool>;
+
+/**
+ * Live slots before the instruction, from the live slots after it.
+ */
+void transferLiveness(const CfgInstruction& instruction, LiveSlots& live) {
+    auto depth = instruction.depth;
+    auto bytes = instruction.bytes.data();
+
+    switch (instruction.opcode()) {
+        case OP_GET_LOCAL:
+            live[depth] = false;
+            live[bytes[1]] = true;
+            return;
+        case OP_SET_LOCAL:
+            live[bytes[1]] = false;
+            live[depth - 1] = true;
+            return;
+        case OP_LOOP_INC_LT:
+            // Reads and writes the counter, reads the end and the step.
+            live[bytes[1]] = live[bytes[1] + 1] = live[bytes[1] + 2] = true;
+            return;
+        case OP_GET_BOXED:
+            live[depth] = false;
+            live[bytes[1]] = true;
+            return;
+        case OP_SET_BOXED:
+            // Writes through the box in the slot.
+            live[bytes[1]] = live[depth - 1] = true;
+            return;
+        case OP_CLOSURE:
+            // Copies the captured locals.
+            live[depth] = false;
+            for (size_t i = 0; i < bytes[2]; i++) {
+                if (bytes[3 + 2 * i]) {
+                    live[bytes[4 + 2 * i]] = true;
+                }
+            }
+            return;
+        case OP_SCOPE_EXIT:
+            // Moves the result over the locals, which are not read.
+            live[depth - 1 - bytes[1]] = false;
+            live[depth - 1] = true;
+            return;
+        case OP_POP:
+            return;
+    }
+
+    // The inputs are replaced by the outputs.
+    auto inputs = stackInputs(bytes);
+    auto outputs = inputs + stackEffect(bytes);
+    for (auto slot = depth - inputs; slot < depth - inputs + outputs; slot++) {
+        live[slot] = false;
+    }
+    for (auto slot = depth - inputs; slot < depth; slot++) {
+        live[slot] = true;
+    }
+}
+
+/**
+ * Live slots at the end of each block (empty for unreachable ones).
+ */
+std::vector<LiveSlots> computeLiveness(const ControlFlowGraph& cfg) {
+    auto slots = cfg.maxDepth + 1;
+    auto& blocks = cfg.blocks;
+
+    std::vector<LiveSlots> liveOut(blocks.size());
+    std::vector<LiveSlots> liveIn(blocks.size());
+    std::vector<BlockId> worklist;
+    std::vector<bool> queued(blocks.size(), false);
+
+    for (BlockId id = 0; id < blocks.size(); id++) {
+        if (blocks[id].isReachable()) {
+            liveOut[id].assign(slots, false);
+            liveIn[id].assign(slots, false);
+            worklist.push_back(id);
+            queued[id] = true;
+        }
+    }
+
+    // Backwards: the last blocks are at the back of the worklist.
+    while (!worklist.empty()) {
+        auto id = worklist.back();
+        worklist.pop_back();
+        queued[id] = false;
+
+        auto& out = liveOut[id];
+        std::fill(out.begin(), out.end(), false);
+        for (auto successor : blocks[id].successors) {
+            for (size_t slot = 0; slot < slots; slot++) {
+                out[slot] = out[slot] || liveIn[successor][slot];
+            }
+        }
+
+        auto live = out;
+        auto& instructions = blocks[id].instructions;
+        for (auto it = instructions.rbegin(); it != instructions.rend(); ++it) {
+            transferLiveness(*it, live);
+        }
+
+        if (live != liveIn[id]) {
+            liveIn[id] = std::move(live);
+            for (auto predecessor : blocks[id].predecessors) {
+                if (blocks[predecessor].isReachable() && !queued[predecessor]) {
+                    worklist.insert(worklist.begin(), predecessor);
+                    queued[predecessor] = true;
+                }
+            }
+        }
+    }
+
+    return liveOut;
+}
+
+#endif //RETROSEVAVM_EVACFG_H
@@ -0,0 +1,212 @@
+//
+// Created by Retros on 2023/5/7.
+//
+
+#ifndef RETROSEVAVM_EVACAPTUREANALYSIS_H
+#define RETROSEVAVM_EVACAPTUREANALYSIS_H
+
+#include "../parser/EvaParser.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * Finds the local variables that closures share with their function.
+ *
+ * A closure copies the values of the variables it captures when it's
+ * created (flat upvalues). That is only correct if the variable doesn't
+ * change after: a variable assigned in a closure, or after it's
+ * captured, lives in a box instead, which the function and its
+ * closures read and write through.
+ *
+ * The program is walked in evaluation order, with the scoping of the
+ * compiler. A loop is walked twice: an assignment at the start of the
+ * body comes after the captures in the previous iteration, while the
+ * variables declared in the body are new in each iteration.
+ *
+ * The counter of a for loop is captured with its value in the iteration
+ * (LOOP_INC_LT updates the slot itself), it can't be assigned after a
+ * capture.
+ */
+class EvaCaptureAnalysis {
+public:
+    /**
+     * Declarations (var, def and for expressions, lambda parameters)
+     * of the variables to box in the top-level code.
+     */
+    std::set<const Exp*> findBoxed(const Exp& program) {
+        boxed.clear();
+        variables.clear();
+        scopes.clear();
+        function = 0;
+
+        visit(program);
+
+        return boxed;
+    }
+
+private:
+    struct Variable {
+        /**
+         * Depth of the function declaring it (0 is the top-level code).
+         */
+        size_t function;
+
+        /**
+         * Whether a closure captured the current value.
+         */
+        bool isCaptured;
+    };
+
+    /**
+     * Names declared in a scope, and their declarations.
+     */
+    using Scope = std::vector<std::pair<std::string, const Exp*>>;
+
+    void visit(const Exp& exp) {
+        if (exp.type == ExpType::SYMBOL) {
+            reference(exp.string);
+            return;
+        }
+        if (exp.type != ExpType::LIST || exp.list.empty()) {
+            return;
+        }
+
+        auto& tag = exp.list[0];
+        auto op = tag.type == ExpType::SYMBOL ? tag.string : "";
+
+        if (op == "var" && exp.list.size() == 3) {
+            visit(exp.list[2]);
+            declare(exp.list[1].string, &exp);
+        } else if (op == "set" && exp.list.size() == 3) {
+            visit(exp.list[2]);
+            assign(exp.list[1].string);
+        } else if (op == "def" && exp.list.size() == 4) {
+            // A local function is declared first, so that it can call itself.
+            if (isGlobalScope()) {
+                visitFunction(exp.list[2], exp.list[3]);
+            } else {
+                declare(exp.list[1].string, &exp);
+                visitFunction(exp.list[2], exp.list[3]);
+                assign(exp.list[1].string);
+            }
+        } else if (op == "lambda" && exp.list.size() == 3) {
+            visitFunction(exp.list[1], exp.list[2]);
+        } else if (op == "begin") {
+            scopes.emplace_back();
+            visitItems(exp, 1);
+            scopes.pop_back();
+        } else if (op == "while") {
+            visitItems(exp, 1);
+            visitItems(exp, 1);
+        } else if (op == "for" && exp.list.size() == 6) {
+            visit(exp.list[2]);
+            visit(exp.list[3]);
+            visit(exp.list[4]);
+            scopes.emplace_back();
+            declare(exp.list[1].string, &exp);
+            visit(exp.list[5]);
+            visit(exp.list[5]);
+            scopes.pop_back();
+        } else if (op == "switch") {
+            // The case keys are literals.
+            visitItems(exp, 1, 2);
+            for (size_t i = 2; i < exp.list.size(); i++) {
+                visitItems(exp.list[i], 1);
+            }
+        } else {
+            visitItems(exp, 0);
+        }
+    }
+
+    void visitItems(const Exp& exp, size_t first, size_t end = (size_t)-1) {
+        if (exp.type != ExpType::LIST) {
+            return;
+        }
+        for (auto i = first; i < std::min(end, exp.list.size()); i++) {
+            visit(exp.list[i]);
+        }
+    }
+
+    /**
+     * (lambda (<params>) <body>)
+     */
+    void visitFunction(const Exp& params, const Exp& body) {
+        function++;
+        scopes.emplace_back();
+        if (params.type == ExpType::LIST) {
+            for (auto& param : params.list) {
+                declare(param.string, &param);
+            }
+        }
+        visit(body);
+        scopes.pop_back();
+        function--;
+    }
+
+    /**
+     * Top-level variables are globals (see EvaCompiler::isGlobalScope).
+     */
+    bool isGlobalScope() { return function == 0 && scopes.size() == 1; }
+
+    void declare(const std::string& name, const Exp* declaration) {
+        if (isGlobalScope()) {
+            return;
+        }
+        // Declared again by a loop: a new variable.
+        variables[declaration] = {function, false};
+        scopes.back().push_back({name, declaration});
+    }
+
+    void reference(const std::string& name) {
+        auto declaration = lookup(name);
+        if (declaration == nullptr) {
+            return;
+        }
+        auto& variable = variables[declaration];
+        if (variable.function < function) {
+            variable.isCaptured = true;
+        }
+    }
+
+    void assign(const std::string& name) {
+        auto declaration = lookup(name);
+        if (declaration == nullptr) {
+            return;
+        }
+        auto& variable = variables[declaration];
+        if (variable.function < function || variable.isCaptured) {
+            boxed.insert(declaration);
+        }
+    }
+
+    /**
+     * Declaration of the local visible by the name, nullptr for globals.
+     */
+    const Exp* lookup(const std::string& name) {
+        for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+            for (auto it = scope->rbegin(); it != scope->rend(); ++it) {
+                if (it->first == name) {
+                    return it->second;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    std::set<const Exp*> boxed;
+
+    std::map<const Exp*, Variable> variables;
+
+    std::vector<Scope> scopes;
+
+    /**
+     * Depth of the function being walked.
+     */
+    size_t function = 0;
+};
+
+#endif //RETROSEVAVM_EVACAPTUREANALYSIS_H
@@ -30,6 +30,13 @@ public:
             offset = disassembleInstruction(co, offset);
             std::cout << "\n";
         }
+
+        // Functions defined in the code.
+        for (auto& constant : co->constants) {
+            if (IS_CODE(constant)) {
+                disassemble(AS_CODE(constant));
+            }
+        }
     }
 
 private:
@@ -48,30 +55,67 @@ private:
             case OP_SUB:
             case OP_MUL:
             case OP_DIV:
+            case OP_ADD_NUM:
+            case OP_SUB_NUM:
+            case OP_MUL_NUM:
+            case OP_DIV_NUM:
+            case OP_GET_INDEX:
+            case OP_SET_INDEX:
+            case OP_HAS_KEY:
+            case OP_DELETE_KEY:
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE:
+            case OP_RETURN:
+            case OP_BOX:
             case OP_POP: {
                 return disassembleSimple(co, opcode, offset);
             }
-            case OP_SCOPE_EXIT: {
+            case OP_SCOPE_EXIT:
+            case OP_CALL:
+            case OP_ARRAY:
+            case OP_MAP: {
                 return disassembleWord(co, opcode, offset);
             }
             case OP_CONST: {
                 return disassembleConst(co, opcode, offset);
             }
-            case OP_COMPARE: {
+            case OP_PUSH_SMALLINT8:
+            case OP_PUSH_SMALLINT16: {
+                return disassembleSmallInt(co, opcode, offset);
+            }
+            case OP_COMPARE:
+            case OP_COMPARE_NUM: {
                 return disassembleCompare(co, opcode, offset);
             }
             case OP_JMP_IF_FALSE:
+            case OP_JMP_IF_TRUE:
             case OP_JMP: {
                 return disassembleJump(co, opcode, offset);
             }
+            case OP_LOOP_INC_LT: {
+                return disassembleLoop(co, opcode, offset);
+            }
+            case OP_TABLE_SWITCH:
+            case OP_LOOKUP_SWITCH: {
+                return disassembleSwitch(co, opcode, offset);
+            }
             case OP_GET_GLOBAL:
             case OP_SET_GLOBAL: {
                 return disassembleGlobal(co, opcode, offset);
             }
             case OP_GET_LOCAL:
-            case OP_SET_LOCAL: {
+            case OP_SET_LOCAL:
+            case OP_GET_BOXED:
+            case OP_SET_BOXED: {
                 return disassembleLocal(co, opcode, offset);
             }
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE: {
+                return disassembleUpvalue(co, opcode, offset);
+            }
+            case OP_CLOSURE: {
+                return disassembleClosure(co, opcode, offset);
+            }
             default: {
                 DIE << "disassembleInstruction: no disassembly for "
                     << opcodeToString(opcode);
@@ -103,6 +147,16 @@ private:
         return offset + 2;
     }
 
+    size_t disassembleSmallInt(CodeObject* co, uint8_t opcode, size_t offset) {
+        auto size = instructionSize(&co->code[offset]);
+        dumpBytes(co, offset, size);
+        printOpCode(opcode);
+        auto value = opcode == OP_PUSH_SMALLINT8 ? (int8_t)co->code[offset + 1]
+                                                : (int16_t)readWordAtOffset(co, offset + 1);
+        std::cout << std::to_string(value);
+        return offset + size;
+    }
+
     size_t disassembleCompare(CodeObject* co, uint8_t opcode, size_t offset) {
         dumpBytes(co, offset, 2);
         printOpCode(opcode);
@@ -128,6 +182,60 @@ private:
 
     }
 
+    size_t disassembleLoop(CodeObject* co, uint8_t opcode, size_t offset) {
+        std::ios_base::fmtflags f(std::cout.flags());
+
+        dumpBytes(co, offset, 4);
+        printOpCode(opcode);
+        auto localIndex = co->code[offset + 1];
+        uint16_t address = readWordAtOffset(co, offset + 2);
+        std::cout << (int)localIndex << " (" << localName(co, localIndex) << ") "
+                  << std::uppercase << std::hex << std::setfill('0') << std::right << std::setw(4)
+                  << (int)address;
+
+        std::cout.flags(f);
+
+        return offset + 4;
+    }
+
+    /**
+     * Prints the switch table on the following lines:
+     * one `<key> -> <address>` per case, then the default.
+     */
+    size_t disassembleSwitch(CodeObject* co, uint8_t opcode, size_t offset) {
+        std::ios_base::fmtflags f(std::cout.flags());
+
+        dumpBytes(co, offset, 2);
+        printOpCode(opcode);
+        auto tableIndex = co->code[offset + 1];
+        auto& table = co->switchTables[tableIndex];
+        std::cout << (int)tableIndex;
+
+        auto printCase = [&](const std::string& key, uint16_t address) {
+            std::cout << "\n" << std::string(20, ' ') << std::left << std::setfill(' ') << std::setw(20) << key
+                      << " -> " << std::uppercase << std::hex << std::setfill('0') << std::right
+                      << std::setw(4) << (int)address;
+            std::cout.flags(f);
+        };
+
+        for (size_t i = 0; i < table.targets.size(); i++) {
+            if (table.targets[i] != table.defaultTarget) {
+                printCase(std::to_string(table.low + i), table.targets[i]);
+            }
+        }
+        for (auto& entry : table.intCases) {
+            printCase(std::to_string(entry.first), entry.second);
+        }
+        for (auto& entry : table.stringCases) {
+            printCase("\"" + entry.first + "\"", entry.second);
+        }
+        printCase("else", table.defaultTarget);
+
+        std::cout.flags(f);
+
+        return offset + 2;
+    }
+
     size_t disassembleGlobal(CodeObject* co, uint8_t opcode, size_t offset) {
         dumpBytes(co, offset, 2);
         printOpCode(opcode);
@@ -137,15 +245,52 @@ private:
         return offset + 2;
     }
 
+    static const std::string& localName(CodeObject* co, uint8_t localIndex) {
+        static const std::string unknown = "?";
+        return localIndex < co->localNames.size() ? co->localNames[localIndex] : unknown;
+    }
+
     size_t disassembleLocal(CodeObject* co, uint8_t opcode, size_t offset) {
         dumpBytes(co, offset, 2);
         printOpCode(opcode);
         auto localIndex = co->code[offset + 1];
-        std::cout << (int)localIndex << " (" << co->locals[localIndex].name
-                  << ")";
+        std::cout << (int)localIndex << " (" << localName(co, localIndex) << ")";
         return offset + 2;
     }
 
+    size_t disassembleUpvalue(CodeObject* co, uint8_t opcode, size_t offset) {
+        dumpBytes(co, offset, 2);
+        printOpCode(opcode);
+        auto index = co->code[offset + 1];
+        std::cout << (int)index << " (" << (index < co->upvalues.size() ? co->upvalues[index].name : "?") << ")";
+        return offset + 2;
+    }
+
+    /**
+     * Prints the captured variables on the following lines:
+     * `local <slot>` or `upvalue <index>` each.
+     */
+    size_t disassembleClosure(CodeObject* co, uint8_t opcode, size_t offset) {
+        dumpBytes(co, offset, 3);
+        printOpCode(opcode);
+        auto constIndex = co->code[offset + 1];
+        auto count = co->code[offset + 2];
+        std::cout << (int)constIndex << " (" << evaValueToConstantString(co->constants[constIndex]) << ")";
+
+        for (size_t i = 0; i < count; i++) {
+            auto isLocal = co->code[offset + 3 + 2 * i];
+            auto index = co->code[offset + 4 + 2 * i];
+            std::cout << "\n" << std::string(20, ' ');
+            if (isLocal) {
+                std::cout << "local " << (int)index << " (" << localName(co, index) << ")";
+            } else {
+                std::cout << "upvalue " << (int)index << " ("
+                          << (index < co->upvalues.size() ? co->upvalues[index].name : "?") << ")";
+            }
+        }
+        return offset + 3 + 2 * count;
+    }
+
     uint16_t readWordAtOffset(CodeObject* co, size_t offset) {
         return (uint16_t)((co->code[offset] << 8) | co->code[offset + 1]);
     }
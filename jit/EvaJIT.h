@@ -0,0 +1,750 @@
+//
+// Created by Retros on 2023/3/11.
+//
+
+#ifndef RETROSEVAVM_EVAJIT_H
+#define RETROSEVAVM_EVAJIT_H
+
+// Off with the opcode stats (see EvaOpcodeStats.h), which only
+// count the instructions run by the interpreter.
+#if defined(EVA_JIT) && defined(__x86_64__) && defined(__unix__) && !defined(EVA_OPCODE_STATS) && \
+    !defined(EVA_OPCODE_CYCLES)
+#define EVA_JIT_ENABLED 1
+#endif
+
+#ifdef EVA_JIT_ENABLED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "../OpCode.h"
+#include "../EvaValue.h"
+#include "../Global.h"
+
+/**
+ * Loop back-edges taken by a code object before it is compiled.
+ */
+const size_t JIT_THRESHOLD = 1000;
+
+/**
+ * Interpreter state shared with the compiled code.
+ */
+struct JitFrame {
+    EvaValue* sp;
+    EvaValue* bp;
+    EvaValue* constants;
+    GlobalVar* globals;
+};
+
+/**
+ * Compiled code: enters at a bytecode offset, and returns
+ * the bytecode offset at which the interpreter resumes.
+ */
+using JitEntry = uint32_t (*)(JitFrame* frame, const uint8_t* target);
+
+/**
+ * Machine code of a code object.
+ */
+struct JitCode {
+    JitCode(uint8_t* memory, size_t size, std::vector<uint32_t> labels)
+        : memory(memory), size(size), labels(std::move(labels)) {}
+
+    ~JitCode() { ::munmap(memory, size); }
+
+    /**
+     * Runs the code from the instruction at `offset`.
+     */
+    uint32_t run(JitFrame* frame, size_t offset) {
+        return ((JitEntry)memory)(frame, memory + labels[offset]);
+    }
+
+    /**
+     * Executable memory.
+     */
+    uint8_t* memory;
+    size_t size;
+
+    /**
+     * Machine code offset of each bytecode offset.
+     */
+    std::vector<uint32_t> labels;
+};
+
+/**
+ * Baseline template JIT for x86-64.
+ *
+ * Each instruction is translated by its own template working on
+ * the interpreter's operand stack, so the machine code and the
+ * interpreter can hand over to each other at any instruction.
+ * Type guards and instructions without a template leave to the
+ * interpreter (side exits) at the offset of the instruction.
+ *
+ * Registers: rbx - sp, r12 - bp, r13 - frame, r14 - constants,
+ * r15 - globals.
+ */
+class EvaJIT {
+public:
+    /**
+     * Compiles a code object, returns nullptr on failure.
+     */
+    std::shared_ptr<JitCode> compile(CodeObject* co) {
+        buf.clear();
+        jumps.clear();
+        exits.clear();
+        jumpTables.clear();
+
+        std::vector<uint32_t> labels(co->code.size() + 1, 0);
+
+        emitPrologue();
+
+        auto exitLabel = emitEpilogue();
+
+        size_t offset = 0;
+        while (offset < co->code.size()) {
+            labels[offset] = (uint32_t)buf.size();
+            offset = emitInstruction(co, offset);
+        }
+
+        // Falling off the end is never reached, but stays safe.
+        labels[offset] = (uint32_t)buf.size();
+        emitExit(offset, exitLabel);
+
+        // Out-of-line side exits.
+        for (auto& exit : exits) {
+            patchRel32(exit.first, buf.size());
+            emitExit(exit.second, exitLabel);
+        }
+
+        for (auto& jump : jumps) {
+            patchRel32(jump.first, labels[jump.second]);
+        }
+
+        for (auto& table : jumpTables) {
+            for (size_t i = 0; i < table.second->targets.size(); i++) {
+                auto rel = (int32_t)(labels[table.second->targets[i]] - table.first);
+                std::memcpy(&buf[table.first + 4 * i], &rel, 4);
+            }
+        }
+
+        return install(std::move(labels));
+    }
+
+private:
+    enum Reg {
+        RAX = 0, RCX = 1, RBX = 3, RSI = 6, RDI = 7,
+        R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+    };
+
+    static constexpr int SP = RBX;
+    static constexpr int BP = R12;
+    static constexpr int FRAME = R13;
+    static constexpr int CONSTANTS = R14;
+    static constexpr int GLOBALS = R15;
+
+    static constexpr int32_t SLOT = sizeof(EvaValue);
+    static constexpr int32_t PAYLOAD = offsetof(EvaValue, number);
+
+    static_assert(sizeof(EvaValue) == 16, "EvaValue layout");
+    static_assert(sizeof(EvaValueType) == 4, "EvaValue layout");
+
+    size_t emitInstruction(CodeObject* co, size_t offset) {
+        auto code = co->code.data();
+        auto opcode = code[offset];
+
+        switch (opcode) {
+            case OP_CONST: {
+                pushFrom(CONSTANTS, code[offset + 1] * SLOT);
+                return offset + 2;
+            }
+            case OP_PUSH_SMALLINT8: {
+                pushImmediate(EvaValueType::INT, (int8_t)code[offset + 1]);
+                return offset + 2;
+            }
+            case OP_PUSH_SMALLINT16: {
+                pushImmediate(EvaValueType::INT, (int16_t)readWord(code, offset + 1));
+                return offset + 3;
+            }
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE: {
+                pushImmediate(EvaValueType::BOOLEAN, opcode == OP_PUSH_TRUE);
+                return offset + 1;
+            }
+            case OP_GET_LOCAL: {
+                pushFrom(BP, code[offset + 1] * SLOT);
+                return offset + 2;
+            }
+            case OP_SET_LOCAL: {
+                storeTop(BP, code[offset + 1] * SLOT);
+                return offset + 2;
+            }
+            case OP_GET_GLOBAL: {
+                pushFrom(GLOBALS, globalValueOffset(code[offset + 1]));
+                return offset + 2;
+            }
+            case OP_SET_GLOBAL: {
+                // Objects may need to be promoted from the arena:
+                // cmp dword [rbx - 16], OBJECT; je <exit>
+                mem(0, {0x83}, 7, SP, -SLOT);
+                byte((uint8_t)EvaValueType::OBJECT);
+                sideExit({0x0F, 0x84}, offset);
+
+                storeTop(GLOBALS, globalValueOffset(code[offset + 1]));
+                return offset + 2;
+            }
+            case OP_POP: {
+                adjustSp(-SLOT);
+                return offset + 1;
+            }
+            case OP_SCOPE_EXIT: {
+                auto count = (int32_t)code[offset + 1];
+                // move the result above the vars:
+                movups(0x10, 0, SP, -SLOT);
+                movups(0x11, 0, SP, -SLOT - count * SLOT);
+                adjustSp(-count * SLOT);
+                return offset + 2;
+            }
+            case OP_ADD:
+            case OP_ADD_NUM: {
+                arithmetic({0x03}, 0x58, offset);
+                return offset + 1;
+            }
+            case OP_SUB:
+            case OP_SUB_NUM: {
+                arithmetic({0x2B}, 0x5C, offset);
+                return offset + 1;
+            }
+            case OP_MUL:
+            case OP_MUL_NUM: {
+                arithmetic({0x0F, 0xAF}, 0x59, offset);
+                return offset + 1;
+            }
+            case OP_DIV:
+            case OP_DIV_NUM: {
+                // Division always produces a double.
+                arithmetic({}, 0x5E, offset);
+                return offset + 1;
+            }
+            case OP_COMPARE:
+            case OP_COMPARE_NUM: {
+                compare(code[offset + 1], offset);
+                return offset + 2;
+            }
+            case OP_JMP_IF_FALSE:
+            case OP_JMP_IF_TRUE: {
+                branch(code[offset] == OP_JMP_IF_TRUE, readWord(code, offset + 1));
+                return offset + 3;
+            }
+            case OP_JMP: {
+                jumpTo({0xE9}, readWord(code, offset + 1));
+                return offset + 3;
+            }
+            case OP_LOOP_INC_LT: {
+                loopIncrement(code[offset + 1], readWord(code, offset + 2), offset);
+                return offset + 4;
+            }
+            case OP_TABLE_SWITCH: {
+                tableSwitch(co->switchTables[code[offset + 1]], offset);
+                return offset + 2;
+            }
+            case OP_LOOKUP_SWITCH: {
+                lookupSwitch(co->switchTables[code[offset + 1]], offset);
+                return offset + 2;
+            }
+            default: {
+                // OP_HALT and the rest run in the interpreter.
+                sideExit({0xE9}, offset);
+                return offset + instructionSize(code + offset);
+            }
+        }
+    }
+
+    /**
+     * Pushes a value given by its type and (sign-extended) payload:
+     * mov dword [rbx], type; mov qword [rbx + 8], payload; add rbx, 16
+     */
+    void pushImmediate(EvaValueType type, int32_t payload) {
+        mem(0, {0xC7}, 0, SP, 0);
+        dword((uint32_t)type);
+        mem(0, {0xC7}, 0, SP, PAYLOAD, true);
+        dword((uint32_t)payload);
+        adjustSp(SLOT);
+    }
+
+    /**
+     * Number math. Two ints use the integer ALU (`intOpcode`, a
+     * `rax, [m]` form), leaving on overflow; other numbers are
+     * converted to doubles. Anything else leaves to the interpreter.
+     */
+    void arithmetic(std::initializer_list<uint8_t> intOpcode, uint8_t sseOpcode, size_t offset) {
+        auto v1 = -2 * SLOT + PAYLOAD;
+        auto v2 = -SLOT + PAYLOAD;
+
+        std::vector<size_t> toDouble;
+        size_t done = 0;
+
+        if (intOpcode.size() > 0) {
+            toDouble.push_back(jumpIfNotType({0x0F, 0x85}, -SLOT, EvaValueType::INT));
+            toDouble.push_back(jumpIfNotType({0x0F, 0x85}, -2 * SLOT, EvaValueType::INT));
+
+            // mov rax, [v1]; <op> rax, [v2]; jo <exit>; mov [v1], rax
+            mem(0, {0x8B}, RAX, SP, v1, true);
+            mem(0, intOpcode, RAX, SP, v2, true);
+            sideExit({0x0F, 0x80}, offset);
+            mem(0, {0x89}, RAX, SP, v1, true);
+            done = jumpForward({0xE9});
+        }
+
+        for (auto jump : toDouble) {
+            bindHere(jump);
+        }
+
+        // <op>sd xmm0, xmm1; movsd [v1], xmm0; mov dword [rbx - 32], NUMBER
+        loadDouble(0, -2 * SLOT, offset);
+        loadDouble(1, -SLOT, offset);
+        bytes({0xF2, 0x0F, sseOpcode, 0xC1});
+        mem(0xF2, {0x0F, 0x11}, 0, SP, v1);
+        mem(0, {0xC7}, 0, SP, -2 * SLOT);
+        dword((uint32_t)EvaValueType::NUMBER);
+
+        if (intOpcode.size() > 0) {
+            bindHere(done);
+        }
+        adjustSp(-SLOT);
+    }
+
+    /**
+     * Number comparison, see EvaCompiler::compareOps_. Two ints are
+     * compared as integers, other numbers as doubles. Unordered (NaN)
+     * operands compare as false, except for `!=`.
+     */
+    void compare(uint8_t op, size_t offset) {
+        if (op > 5) {
+            sideExit({0xE9}, offset);
+            return;
+        }
+
+        // Signed integer conditions of `cmp v1, v2`.
+        static const uint8_t intConditions[] = {
+            0x9C,  // <:  setl
+            0x9F,  // >:  setg
+            0x94,  // ==: sete
+            0x9D,  // >=: setge
+            0x9E,  // <=: setle
+            0x95,  // !=: setne
+        };
+
+        auto toDouble1 = jumpIfNotType({0x0F, 0x85}, -SLOT, EvaValueType::INT);
+        auto toDouble2 = jumpIfNotType({0x0F, 0x85}, -2 * SLOT, EvaValueType::INT);
+
+        // mov rax, [v1]; cmp rax, [v2]; setcc al
+        mem(0, {0x8B}, RAX, SP, -2 * SLOT + PAYLOAD, true);
+        mem(0, {0x3B}, RAX, SP, -SLOT + PAYLOAD, true);
+        setcc(intConditions[op], RAX);
+        auto done = jumpForward({0xE9});
+
+        bindHere(toDouble1);
+        bindHere(toDouble2);
+        loadDouble(0, -2 * SLOT, offset);
+        loadDouble(1, -SLOT, offset);
+
+        // ucomisd with the operands ordered so that
+        // "above" is the condition being tested.
+        auto ucomisd = [&](int lhs, int rhs) { bytes({0x66, 0x0F, 0x2E, (uint8_t)(0xC0 | lhs << 3 | rhs)}); };
+
+        switch (op) {
+            case 0: ucomisd(1, 0); setcc(0x97, RAX); break;      // <:  v2 above v1
+            case 1: ucomisd(0, 1); setcc(0x97, RAX); break;      // >:  v1 above v2
+            case 2:                                              // ==: equal and ordered
+                ucomisd(0, 1);
+                setcc(0x94, RAX);
+                setcc(0x9B, RCX);
+                bytes({0x20, 0xC8});                             // and al, cl
+                break;
+            case 3: ucomisd(0, 1); setcc(0x93, RAX); break;      // >=: v1 above or equal v2
+            case 4: ucomisd(1, 0); setcc(0x93, RAX); break;      // <=: v2 above or equal v1
+            case 5:                                              // !=: not equal or unordered
+                ucomisd(0, 1);
+                setcc(0x95, RAX);
+                setcc(0x9A, RCX);
+                bytes({0x08, 0xC8});                             // or al, cl
+                break;
+        }
+
+        bindHere(done);
+
+        // The result replaces the first operand:
+        // sub rbx, 16; mov dword [rbx - 16], BOOLEAN; mov byte [rbx - 8], al
+        adjustSp(-SLOT);
+        mem(0, {0xC7}, 0, SP, -SLOT);
+        dword((uint32_t)EvaValueType::BOOLEAN);
+        mem(0, {0x88}, RAX, SP, -SLOT + PAYLOAD);
+    }
+
+    /**
+     * Pops a condition, and jumps to `address` if it's truthy
+     * (`ifTruthy`) or falsy (see IS_FALSY): only a false boolean is falsy.
+     */
+    void branch(bool ifTruthy, size_t address) {
+        // sub rbx, 16; cmp dword [rbx], BOOLEAN
+        adjustSp(-SLOT);
+        if (ifTruthy) {
+            // jne <address>; cmp byte [rbx + 8], 0; jne <address>
+            mem(0, {0x83}, 7, SP, 0);
+            byte((uint8_t)EvaValueType::BOOLEAN);
+            jumpTo({0x0F, 0x85}, address);
+            mem(0, {0x80}, 7, SP, PAYLOAD);
+            byte(0x00);
+            jumpTo({0x0F, 0x85}, address);
+        } else {
+            // jne <next>; cmp byte [rbx + 8], 0; je <address>
+            auto next = jumpIfNotType({0x0F, 0x85}, 0, EvaValueType::BOOLEAN);
+            mem(0, {0x80}, 7, SP, PAYLOAD);
+            byte(0x00);
+            jumpTo({0x0F, 0x84}, address);
+            bindHere(next);
+        }
+    }
+
+    /**
+     * Counted loop back-edge on int locals: counter += step, and
+     * jumps while counter < end. Other types and overflows are
+     * left to the interpreter (before the counter is written).
+     */
+    void loopIncrement(uint8_t localIndex, size_t address, size_t offset) {
+        auto counter = localIndex * SLOT;
+        auto end = counter + SLOT;
+        auto step = counter + 2 * SLOT;
+
+        for (auto local : {counter, end, step}) {
+            // cmp dword [r12 + local], INT; jne <exit>
+            mem(0, {0x83}, 7, BP, local);
+            byte((uint8_t)EvaValueType::INT);
+            sideExit({0x0F, 0x85}, offset);
+        }
+
+        // mov rax, [counter]; add rax, [step]; jo <exit>; mov [counter], rax
+        mem(0, {0x8B}, RAX, BP, counter + PAYLOAD, true);
+        mem(0, {0x03}, RAX, BP, step + PAYLOAD, true);
+        sideExit({0x0F, 0x80}, offset);
+        mem(0, {0x89}, RAX, BP, counter + PAYLOAD, true);
+
+        // cmp rax, [end]; jl <address>
+        mem(0, {0x3B}, RAX, BP, end + PAYLOAD, true);
+        jumpTo({0x0F, 0x8C}, address);
+    }
+
+    /**
+     * Switch on an int key: indexes a table of rel32 offsets (relative
+     * to the table) placed after the jump. Other keys are left to the
+     * interpreter.
+     */
+    void tableSwitch(const SwitchTable& table, size_t offset) {
+        if (!fitsInt32(table.low) || !fitsInt32((int64_t)table.targets.size())) {
+            sideExit({0xE9}, offset);
+            return;
+        }
+        popIntKey(offset);
+
+        // sub rax, low; cmp rax, size; jae <default>
+        bytes({0x48, 0x2D});
+        dword((uint32_t)table.low);
+        bytes({0x48, 0x3D});
+        dword((uint32_t)table.targets.size());
+        jumpTo({0x0F, 0x83}, table.defaultTarget);
+
+        // lea rcx, [rip + 9] (the table); movsxd rax, dword [rcx + rax * 4];
+        // add rax, rcx; jmp rax
+        bytes({0x48, 0x8D, 0x0D});
+        dword(9);
+        bytes({0x48, 0x63, 0x04, 0x81});
+        bytes({0x48, 0x01, 0xC8});
+        bytes({0xFF, 0xE0});
+
+        jumpTables.push_back({buf.size(), &table});
+        buf.resize(buf.size() + 4 * table.targets.size());
+    }
+
+    /**
+     * Switch on an int key: compares it with each int case.
+     * Other keys are left to the interpreter.
+     */
+    void lookupSwitch(const SwitchTable& table, size_t offset) {
+        for (auto& entry : table.intCases) {
+            if (!fitsInt32(entry.first)) {
+                sideExit({0xE9}, offset);
+                return;
+            }
+        }
+        popIntKey(offset);
+
+        // cmp rax, key; je <target>
+        for (auto& entry : table.intCases) {
+            bytes({0x48, 0x3D});
+            dword((uint32_t)entry.first);
+            jumpTo({0x0F, 0x84}, entry.second);
+        }
+        jumpTo({0xE9}, table.defaultTarget);
+    }
+
+    /**
+     * Pops the int on top of the stack to rax,
+     * leaving to the interpreter if it's not an int.
+     */
+    void popIntKey(size_t offset) {
+        // cmp dword [rbx - 16], INT; jne <exit>; mov rax, [rbx - 8]; sub rbx, 16
+        mem(0, {0x83}, 7, SP, -SLOT);
+        byte((uint8_t)EvaValueType::INT);
+        sideExit({0x0F, 0x85}, offset);
+        mem(0, {0x8B}, RAX, SP, -SLOT + PAYLOAD, true);
+        adjustSp(-SLOT);
+    }
+
+    static bool fitsInt32(int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+    /**
+     * Loads the number at [rbx + slot] to xmm as a double:
+     * converts an int, leaves to the interpreter if not a number.
+     */
+    void loadDouble(int xmm, int32_t slot, size_t offset) {
+        auto notInt = jumpIfNotType({0x0F, 0x85}, slot, EvaValueType::INT);
+
+        // cvtsi2sd xmm, qword [slot + 8]
+        mem(0xF2, {0x0F, 0x2A}, xmm, SP, slot + PAYLOAD, true);
+        auto loaded = jumpForward({0xE9});
+
+        // cmp dword [slot], NUMBER; jne <exit>; movsd xmm, [slot + 8]
+        bindHere(notInt);
+        mem(0, {0x83}, 7, SP, slot);
+        byte((uint8_t)EvaValueType::NUMBER);
+        sideExit({0x0F, 0x85}, offset);
+        mem(0xF2, {0x0F, 0x10}, xmm, SP, slot + PAYLOAD);
+
+        bindHere(loaded);
+    }
+
+    /**
+     * cmp dword [rbx + slot], type; j<cc> <forward>
+     */
+    size_t jumpIfNotType(std::initializer_list<uint8_t> jump, int32_t slot, EvaValueType type) {
+        mem(0, {0x83}, 7, SP, slot);
+        byte((uint8_t)type);
+        return jumpForward(jump);
+    }
+
+    // -------------------------------------------------
+    // Stack templates.
+
+    /**
+     * Pushes the value at [base + disp].
+     */
+    void pushFrom(int base, int32_t disp) {
+        movups(0x10, 0, base, disp);
+        movups(0x11, 0, SP, 0);
+        adjustSp(SLOT);
+    }
+
+    /**
+     * Stores the top value to [base + disp], without popping it.
+     */
+    void storeTop(int base, int32_t disp) {
+        movups(0x10, 0, SP, -SLOT);
+        movups(0x11, 0, base, disp);
+    }
+
+    /**
+     * add/sub rbx, imm32
+     */
+    void adjustSp(int32_t delta) {
+        if (delta == 0) {
+            return;
+        }
+        bytes({0x48, 0x81, (uint8_t)(delta > 0 ? 0xC3 : 0xEB)});
+        dword((uint32_t)(delta > 0 ? delta : -delta));
+    }
+
+    // -------------------------------------------------
+    // Entry and exit.
+
+    /**
+     * Saves callee-saved registers, loads the frame,
+     * and jumps to the target instruction (rsi).
+     */
+    void emitPrologue() {
+        bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});  // push rbx, r12-r15
+        bytes({0x49, 0x89, 0xFD});                                      // mov r13, rdi
+        mem(0, {0x8B}, SP, FRAME, offsetof(JitFrame, sp), true);
+        mem(0, {0x8B}, BP, FRAME, offsetof(JitFrame, bp), true);
+        mem(0, {0x8B}, CONSTANTS, FRAME, offsetof(JitFrame, constants), true);
+        mem(0, {0x8B}, GLOBALS, FRAME, offsetof(JitFrame, globals), true);
+        bytes({0xFF, 0xE6});                                            // jmp rsi
+    }
+
+    /**
+     * Stores sp back to the frame, and returns eax.
+     */
+    size_t emitEpilogue() {
+        auto label = buf.size();
+        mem(0, {0x89}, SP, FRAME, offsetof(JitFrame, sp), true);
+        bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B});  // pop r15-r12, rbx
+        byte(0xC3);                                                     // ret
+        return label;
+    }
+
+    /**
+     * mov eax, <offset>; jmp <epilogue>
+     */
+    void emitExit(size_t offset, size_t exitLabel) {
+        byte(0xB8);
+        dword((uint32_t)offset);
+        byte(0xE9);
+        dword(0);
+        patchRel32(buf.size() - 4, exitLabel);
+    }
+
+    /**
+     * Jump (with a rel32) to a side exit at a bytecode offset.
+     */
+    void sideExit(std::initializer_list<uint8_t> jump, size_t offset) {
+        bytes(jump);
+        dword(0);
+        exits.push_back({buf.size() - 4, offset});
+    }
+
+    /**
+     * Jump (with a rel32) forward within the template,
+     * bound later with bindHere().
+     */
+    size_t jumpForward(std::initializer_list<uint8_t> jump) {
+        bytes(jump);
+        dword(0);
+        return buf.size() - 4;
+    }
+
+    void bindHere(size_t at) { patchRel32(at, buf.size()); }
+
+    /**
+     * Jump (with a rel32) to a bytecode offset.
+     */
+    void jumpTo(std::initializer_list<uint8_t> jump, size_t address) {
+        bytes(jump);
+        dword(0);
+        jumps.push_back({buf.size() - 4, address});
+    }
+
+    void patchRel32(size_t at, size_t target) {
+        auto rel = (int32_t)((int64_t)target - (int64_t)(at + 4));
+        std::memcpy(&buf[at], &rel, 4);
+    }
+
+    /**
+     * Copies the code to executable memory.
+     */
+    std::shared_ptr<JitCode> install(std::vector<uint32_t> labels) {
+        auto pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+        auto size = (buf.size() + pageSize - 1) / pageSize * pageSize;
+
+        auto memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+
+        std::memcpy(memory, buf.data(), buf.size());
+
+        if (::mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            ::munmap(memory, size);
+            return nullptr;
+        }
+
+        return std::make_shared<JitCode>((uint8_t*)memory, size, std::move(labels));
+    }
+
+    // -------------------------------------------------
+    // Encoding.
+
+    /**
+     * [legacy prefix] [REX] opcode ModRM [SIB] disp32, for a
+     * `reg, [base + disp]` operand pair.
+     */
+    void mem(uint8_t prefix, std::initializer_list<uint8_t> opcode, int reg, int base,
+             int32_t disp, bool wide = false) {
+        if (prefix != 0) {
+            byte(prefix);
+        }
+        uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (base >> 3);
+        if (rex != 0x40) {
+            byte(rex);
+        }
+        bytes(opcode);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == 4) {
+            byte(0x24);
+        }
+        dword((uint32_t)disp);
+    }
+
+    /**
+     * movups xmm, [base + disp] (0x10) / movups [base + disp], xmm (0x11)
+     */
+    void movups(uint8_t opcode, int xmm, int base, int32_t disp) {
+        mem(0, {0x0F, opcode}, xmm, base, disp);
+    }
+
+    /**
+     * setcc r8 (al or cl)
+     */
+    void setcc(uint8_t cc, int reg) { bytes({0x0F, cc, (uint8_t)(0xC0 | reg)}); }
+
+    void byte(uint8_t b) { buf.push_back(b); }
+
+    void bytes(std::initializer_list<uint8_t> bs) { buf.insert(buf.end(), bs); }
+
+    void dword(uint32_t d) {
+        for (auto i = 0; i < 4; i++) {
+            byte((d >> (i * 8)) & 0xFF);
+        }
+    }
+
+    static uint16_t readWord(const uint8_t* code, size_t offset) {
+        return (uint16_t)((code[offset] << 8) | code[offset + 1]);
+    }
+
+    /**
+     * Offset of a global's value in the globals array.
+     */
+    static int32_t globalValueOffset(size_t index) {
+        static const GlobalVar probe{};
+        auto valueOffset = (int32_t)((const char*)&probe.value - (const char*)&probe);
+        return (int32_t)(index * sizeof(GlobalVar)) + valueOffset;
+    }
+
+    /**
+     * Machine code being generated.
+     */
+    std::vector<uint8_t> buf;
+
+    /**
+     * Pending jumps: rel32 position, target bytecode offset.
+     */
+    std::vector<std::pair<size_t, size_t>> jumps;
+
+    /**
+     * Pending side exits: rel32 position, bytecode offset.
+     */
+    std::vector<std::pair<size_t, size_t>> exits;
+
+    /**
+     * Pending jump tables: position, switch table.
+     */
+    std::vector<std::pair<size_t, const SwitchTable*>> jumpTables;
+};
+
+#endif //EVA_JIT_ENABLED
+
+#endif //RETROSEVAVM_EVAJIT_H
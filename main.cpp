@@ -1,9 +1,66 @@
 #include "EvaVM.h"
 #include "EvaValue.h"
 
-int main() {
+#include <unistd.h>
+
+#include <fstream>
+
+int main(int argc, char const *argv[]) {
     EvaVM vm;
 
+    // Scripts given on the command line ("-" reads stdin).
+    // --profile=<file> writes a sampled profile as folded stacks.
+    // --opt-report prints the bytecode optimizer counters.
+    // --no-opt compiles the scripts after it without optimizations.
+    // --no-jit runs the scripts after it in the interpreter only.
+    if (argc > 1) {
+        std::string profilePath;
+        auto optimizerReport = false;
+
+        for (auto i = 1; i < argc; i++) {
+            std::string path = argv[i];
+
+            if (path.rfind("--profile=", 0) == 0) {
+                profilePath = path.substr(10);
+                vm.startProfiling();
+                continue;
+            }
+
+            if (path == "--opt-report") {
+                optimizerReport = true;
+                continue;
+            }
+
+            if (path == "--no-opt") {
+                vm.setOptimizationsEnabled(false);
+                continue;
+            }
+
+            if (path == "--no-jit") {
+                vm.jitEnabled = false;
+                continue;
+            }
+
+            auto result = path == "-" ? vm.execFd(STDIN_FILENO) : vm.execFile(path);
+
+            log(result);
+        }
+
+        if (!profilePath.empty()) {
+            std::ofstream out(profilePath);
+            vm.writeProfile(out);
+        }
+
+        if (optimizerReport) {
+            writeOptimizerReport(vm.getOptimizerStats(), std::cerr);
+        }
+
+#ifdef EVA_OPCODE_STATS
+        writeOpcodeReport(vm.getOpcodeStats(), std::cerr);
+#endif
+        return 0;
+    }
+
     auto result = vm.exec(R"(
         (var i 10)
         (var count 0)
@@ -0,0 +1,277 @@
+//
+// Created by Retros on 2023/5/3.
+//
+
+#ifndef RETROSEVAVM_EVAOPTIMIZER_H
+#define RETROSEVAVM_EVAOPTIMIZER_H
+
+#include "../cfg/EvaCFG.h"
+
+#include <iomanip>
+#include <ostream>
+
+/**
+ * Optimizer counters, over all the code objects.
+ */
+struct OptimizerStats {
+    size_t codeObjects = 0;
+
+    /**
+     * Bytecode size before and after the optimizations.
+     */
+    size_t bytesBefore = 0;
+    size_t bytesAfter = 0;
+
+    size_t foldedBranches = 0;
+    size_t unreachableBlocks = 0;
+    size_t deadStores = 0;
+    size_t deadPushes = 0;
+    size_t removedJumps = 0;
+};
+
+/**
+ * Bytecode optimizer over the control-flow graph:
+ *
+ *  - branches on a pushed boolean (e.g. a folded condition)
+ *    become a jump or nothing;
+ *  - blocks that can't be reached are removed, and a block is
+ *    merged into its only predecessor falling through to it;
+ *  - stores to locals that are not read afterwards are removed (this
+ *    includes the store of a local's initial value, which is pushed
+ *    into the local's slot already);
+ *  - a value pushed without side effects and popped right away
+ *    is not pushed;
+ *  - jumps to the next instruction are removed.
+ *
+ * The passes run until none of them applies.
+ */
+class EvaOptimizer {
+public:
+    void optimize(CodeObject* co) {
+        ControlFlowGraph cfg(co);
+        auto bytesBefore = co->code.size();
+
+        using Pass = bool (EvaOptimizer::*)(ControlFlowGraph&);
+        const Pass passes[] = {&EvaOptimizer::foldBranches, &EvaOptimizer::removeUnreachableBlocks,
+                               &EvaOptimizer::mergeBlocks, &EvaOptimizer::removeDeadStores,
+                               &EvaOptimizer::removeDeadPushes, &EvaOptimizer::removeJumpsToNext};
+
+        for (auto changed = true; changed;) {
+            changed = false;
+            for (auto pass : passes) {
+                // Each pass sees the edges and depths of the code it gets.
+                if ((this->*pass)(cfg)) {
+                    cfg.analyze();
+                    changed = true;
+                }
+            }
+        }
+
+        cfg.encode(co);
+
+        stats.codeObjects++;
+        stats.bytesBefore += bytesBefore;
+        stats.bytesAfter += co->code.size();
+    }
+
+    const OptimizerStats& getStats() const { return stats; }
+
+private:
+    /**
+     * PUSH_TRUE/PUSH_FALSE followed by a conditional jump:
+     * the jump is always or never taken.
+     */
+    bool foldBranches(ControlFlowGraph& cfg) {
+        auto changed = false;
+        for (auto& block : cfg.blocks) {
+            auto& instructions = block.instructions;
+            if (instructions.size() < 2) {
+                continue;
+            }
+            auto& push = instructions[instructions.size() - 2];
+            auto& jump = instructions.back();
+
+            auto isBoolean = push.opcode() == OP_PUSH_TRUE || push.opcode() == OP_PUSH_FALSE;
+            auto isBranch = jump.opcode() == OP_JMP_IF_TRUE || jump.opcode() == OP_JMP_IF_FALSE;
+            if (!isBoolean || !isBranch) {
+                continue;
+            }
+
+            auto taken = (push.opcode() == OP_PUSH_TRUE) == (jump.opcode() == OP_JMP_IF_TRUE);
+            if (taken) {
+                jump.bytes[0] = OP_JMP;
+                instructions.erase(instructions.end() - 2);
+            } else {
+                instructions.resize(instructions.size() - 2);
+            }
+            stats.foldedBranches++;
+            changed = true;
+        }
+        return changed;
+    }
+
+    /**
+     * Removes the unreachable blocks, and the empty ones.
+     */
+    bool removeUnreachableBlocks(ControlFlowGraph& cfg) {
+        std::vector<bool> keep(cfg.blocks.size());
+        auto changed = false;
+        for (BlockId id = 0; id < cfg.blocks.size(); id++) {
+            auto& block = cfg.blocks[id];
+            keep[id] = block.isReachable() && !block.instructions.empty();
+            if (!block.isReachable()) {
+                stats.unreachableBlocks++;
+            }
+            changed = changed || !keep[id];
+        }
+        if (changed) {
+            cfg.removeBlocks(keep);
+        }
+        return changed;
+    }
+
+    /**
+     * Appends a block to the one falling through to it,
+     * if it's its only predecessor.
+     */
+    bool mergeBlocks(ControlFlowGraph& cfg) {
+        auto changed = false;
+        auto& blocks = cfg.blocks;
+        for (BlockId id = 0; id + 1 < blocks.size(); id++) {
+            auto& next = blocks[id + 1];
+            auto onlyFromHere = next.predecessors.size() == 1 && next.predecessors[0] == id;
+            if (!cfg.fallsThrough(id) || !onlyFromHere || next.instructions.empty()) {
+                continue;
+            }
+            auto& instructions = blocks[id].instructions;
+            instructions.insert(instructions.end(), std::make_move_iterator(next.instructions.begin()),
+                                std::make_move_iterator(next.instructions.end()));
+            next.instructions.clear();
+            changed = true;
+
+            // The edges of the emptied block are out of date.
+            id++;
+        }
+        return changed;
+    }
+
+    /**
+     * A SET_LOCAL of a slot that is dead after it (or of the slot
+     * of the stored value itself) is removed: it doesn't change the stack.
+     */
+    bool removeDeadStores(ControlFlowGraph& cfg) {
+        auto liveOut = computeLiveness(cfg);
+        auto changed = false;
+
+        for (BlockId id = 0; id < cfg.blocks.size(); id++) {
+            if (!cfg.blocks[id].isReachable()) {
+                continue;
+            }
+            auto& instructions = cfg.blocks[id].instructions;
+            auto live = liveOut[id];
+
+            for (auto i = instructions.size(); i-- > 0;) {
+                auto& instruction = instructions[i];
+                if (instruction.opcode() == OP_SET_LOCAL) {
+                    auto slot = instruction.bytes[1];
+                    if (!live[slot] || slot == instruction.depth - 1) {
+                        instructions.erase(instructions.begin() + i);
+                        stats.deadStores++;
+                        changed = true;
+                        continue;
+                    }
+                }
+                transferLiveness(instruction, live);
+            }
+        }
+        return changed;
+    }
+
+    /**
+     * A constant or a variable pushed, and popped by the next instruction.
+     */
+    bool removeDeadPushes(ControlFlowGraph& cfg) {
+        auto changed = false;
+        for (auto& block : cfg.blocks) {
+            auto& instructions = block.instructions;
+            for (size_t i = 0; i + 1 < instructions.size();) {
+                if (isPurePush(instructions[i].opcode()) && instructions[i + 1].opcode() == OP_POP) {
+                    instructions.erase(instructions.begin() + i, instructions.begin() + i + 2);
+                    stats.deadPushes++;
+                    changed = true;
+                    // The previous instruction may be a push now followed by a POP.
+                    i = i > 0 ? i - 1 : 0;
+                    continue;
+                }
+                i++;
+            }
+        }
+        return changed;
+    }
+
+    static bool isPurePush(uint8_t opcode) {
+        switch (opcode) {
+            case OP_CONST:
+            case OP_PUSH_SMALLINT8:
+            case OP_PUSH_SMALLINT16:
+            case OP_PUSH_TRUE:
+            case OP_PUSH_FALSE:
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * A JMP to the block that follows (possibly after empty blocks).
+     */
+    bool removeJumpsToNext(ControlFlowGraph& cfg) {
+        auto changed = false;
+        auto& blocks = cfg.blocks;
+        for (BlockId id = 0; id < blocks.size(); id++) {
+            auto& instructions = blocks[id].instructions;
+            if (instructions.empty() || instructions.back().opcode() != OP_JMP) {
+                continue;
+            }
+            auto target = instructions.back().target;
+            auto next = id + 1;
+            while (next < target && blocks[next].instructions.empty()) {
+                next++;
+            }
+            if (next == target) {
+                instructions.pop_back();
+                stats.removedJumps++;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    OptimizerStats stats;
+};
+
+/**
+ * Prints the bytecode size before and after the optimizations,
+ * and what was removed.
+ */
+void writeOptimizerReport(const OptimizerStats& stats, std::ostream& out) {
+    auto f = out.flags();
+    auto saved = stats.bytesBefore - stats.bytesAfter;
+
+    out << "\n---------- Optimizer: " << stats.codeObjects << " code objects ----------\n";
+    out << std::left << std::setw(22) << "bytes before" << stats.bytesBefore << "\n";
+    out << std::setw(22) << "bytes after" << stats.bytesAfter << " (-" << saved << ", " << std::fixed
+        << std::setprecision(1) << (stats.bytesBefore > 0 ? 100.0 * saved / stats.bytesBefore : 0.0)
+        << "%)\n";
+    out << std::setw(22) << "folded branches" << stats.foldedBranches << "\n";
+    out << std::setw(22) << "unreachable blocks" << stats.unreachableBlocks << "\n";
+    out << std::setw(22) << "dead stores" << stats.deadStores << "\n";
+    out << std::setw(22) << "dead pushes" << stats.deadPushes << "\n";
+    out << std::setw(22) << "removed jumps" << stats.removedJumps << "\n";
+
+    out.flags(f);
+}
+
+#endif //RETROSEVAVM_EVAOPTIMIZER_H
@@ -0,0 +1,330 @@
+//
+// Created by Retros on 2023/3/4.
+//
+
+#ifndef RETROSEVAVM_EVAFORMREADER_H
+#define RETROSEVAVM_EVAFORMREADER_H
+
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Default size of a chunk pulled from the source.
+ */
+const size_t FORM_READER_CHUNK_SIZE = 64 * 1024;
+
+/**
+ * Streaming reader of top-level forms.
+ *
+ * Splits the source into complete top-level forms (lists or atoms),
+ * so a program never has to be parsed or compiled as a whole.
+ *
+ * A chunked source (e.g. a file descriptor) is pulled in fixed-size
+ * chunks and only the form being assembled is buffered. A contiguous
+ * source (e.g. a mapped file) is scanned in place, and the returned
+ * forms are views into it.
+ */
+class EvaFormReader {
+public:
+    /**
+     * Fills `buffer` with at most `capacity` bytes,
+     * returns the number of bytes read (0 at the end of input).
+     */
+    using ChunkSource = std::function<size_t(char* buffer, size_t capacity)>;
+
+    EvaFormReader(ChunkSource source, size_t chunkSize = FORM_READER_CHUNK_SIZE)
+        : source(std::move(source)), chunk(chunkSize), data(chunk.data()) {}
+
+    /**
+     * Reads forms in place from a contiguous source
+     * (must outlive the reader and the returned forms).
+     */
+    explicit EvaFormReader(std::string_view program)
+        : data(program.data()), length(program.size()), exhausted(true), contiguous(true) {}
+
+    /**
+     * Reads forms from a file descriptor (not closed by the reader).
+     */
+    static EvaFormReader fromFd(int fd) {
+        return EvaFormReader([fd](char* buffer, size_t capacity) -> size_t {
+            for (;;) {
+                auto n = ::read(fd, buffer, capacity);
+                if (n >= 0) {
+                    return (size_t)n;
+                }
+                if (errno != EINTR) {
+                    throw std::runtime_error("EvaFormReader: read() failed.");
+                }
+            }
+        });
+    }
+
+    /**
+     * Reads the next top-level form. The view stays valid
+     * until the next call. Returns false when the input is exhausted.
+     */
+    bool next(std::string_view& form) {
+        buffer.clear();
+        empty = true;
+
+        int depth = 0;
+        bool inAtom = false;
+
+        for (;;) {
+            auto c = getChar();
+
+            if (c == EOF) {
+                if (depth > 0) {
+                    unexpectedEnd();
+                }
+                return finish(form);
+            }
+
+            // Comments start only at a token boundary. Within a list
+            // they are kept, the tokenizer skips them.
+            if (c == '/' && !inAtom && (peekChar() == '/' || peekChar() == '*')) {
+                if (depth > 0) {
+                    append(c);
+                }
+                skipComment(depth > 0);
+                continue;
+            }
+
+            if (std::isspace(c)) {
+                if (c == '\n') {
+                    line++;
+                }
+                // Whitespace between top-level forms is dropped.
+                if (depth > 0) {
+                    append(c);
+                }
+                inAtom = false;
+                continue;
+            }
+
+            if (empty) {
+                formLine = line;
+            }
+            append(c);
+
+            // Strings are taken verbatim (no escapes in the grammar).
+            if (c == '"') {
+                for (;;) {
+                    auto s = getChar();
+                    if (s == EOF) {
+                        unexpectedEnd();
+                    }
+                    append(s);
+                    if (s == '\n') {
+                        line++;
+                    }
+                    if (s == '"') {
+                        break;
+                    }
+                }
+                inAtom = false;
+                if (depth == 0) {
+                    return finish(form);
+                }
+                continue;
+            }
+
+            if (c == '(') {
+                depth++;
+                inAtom = false;
+                continue;
+            }
+
+            if (c == ')') {
+                if (depth == 0) {
+                    std::string errMsg = "Unexpected token \")\" at line " + std::to_string(line) + ".\n";
+                    std::cerr << errMsg;
+                    throw std::runtime_error(errMsg);
+                }
+                inAtom = false;
+                if (--depth == 0) {
+                    return finish(form);
+                }
+                continue;
+            }
+
+            // Atom character.
+            inAtom = true;
+
+            // A top-level atom ends at the first delimiter.
+            if (depth == 0) {
+                for (;;) {
+                    auto a = peekChar();
+                    if (a == EOF || a == '(' || a == ')' || a == '"' || std::isspace(a)) {
+                        return finish(form);
+                    }
+                    append(getChar());
+                }
+            }
+        }
+    }
+
+    /**
+     * Source line on which the last returned form starts.
+     */
+    size_t formLine = 1;
+
+private:
+    /**
+     * Skips a line or a block comment (the leading '/' is consumed).
+     */
+    void skipComment(bool keep) {
+        auto first = getChar();
+        if (keep) {
+            append(first);
+        }
+
+        if (first == '/') {
+            while (peekChar() != EOF && peekChar() != '\n') {
+                auto c = getChar();
+                if (keep) {
+                    append(c);
+                }
+            }
+            return;
+        }
+
+        for (;;) {
+            auto c = getChar();
+            if (c == EOF) {
+                unexpectedEnd();
+            }
+            if (keep) {
+                append(c);
+            }
+            if (c == '\n') {
+                line++;
+            }
+            if (c == '*' && peekChar() == '/') {
+                getChar();
+                if (keep) {
+                    append('/');
+                }
+                return;
+            }
+        }
+    }
+
+    /**
+     * Appends a consumed character to the current form.
+     */
+    void append(int c) {
+        if (empty) {
+            formStart = position - 1;
+            empty = false;
+        }
+        if (!contiguous) {
+            buffer.push_back((char)c);
+        }
+    }
+
+    /**
+     * Returns the assembled form.
+     */
+    bool finish(std::string_view& form) {
+        if (empty) {
+            return false;
+        }
+        form = contiguous ? std::string_view(data + formStart, position - formStart)
+                          : std::string_view(buffer);
+        return true;
+    }
+
+    /**
+     * Returns the next character without consuming it.
+     */
+    int peekChar() {
+        if (position == length && !fill()) {
+            return EOF;
+        }
+        return (unsigned char)data[position];
+    }
+
+    /**
+     * Consumes the next character.
+     */
+    int getChar() {
+        auto c = peekChar();
+        if (c != EOF) {
+            position++;
+        }
+        return c;
+    }
+
+    /**
+     * Pulls the next chunk from the source.
+     */
+    bool fill() {
+        if (exhausted) {
+            return false;
+        }
+        position = 0;
+        length = source(chunk.data(), chunk.size());
+        if (length == 0) {
+            exhausted = true;
+        }
+        return length > 0;
+    }
+
+    [[noreturn]] void unexpectedEnd() {
+        std::string errMsg = "Unexpected end of input.\n";
+        std::cerr << errMsg;
+        throw std::runtime_error(errMsg);
+    }
+
+    /**
+     * Chunk source.
+     */
+    ChunkSource source;
+
+    /**
+     * Chunk buffer (chunked sources only).
+     */
+    std::vector<char> chunk;
+
+    /**
+     * Data being scanned and read position within it.
+     */
+    const char* data;
+    size_t position = 0;
+    size_t length = 0;
+
+    /**
+     * Whether the source returned the end of input.
+     */
+    bool exhausted = false;
+
+    /**
+     * Whether the whole source is in `data`.
+     */
+    bool contiguous = false;
+
+    /**
+     * Current form: assembled copy (chunked sources),
+     * or start offset within `data` (contiguous sources).
+     */
+    std::string buffer;
+    size_t formStart = 0;
+    bool empty = true;
+
+    /**
+     * Current source line.
+     */
+    size_t line = 1;
+};
+
+#endif //RETROSEVAVM_EVAFORMREADER_H
@@ -27,7 +27,9 @@
 #include <memory>
 #include <regex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ------------------------------------
@@ -61,18 +63,31 @@ enum class ExpType {
 };
 
 
+/**
+ * Source location of an expression (1-based lines,
+ * 0-based columns). Line 0 means unknown.
+ */
+struct Span {
+    int startLine = 0;
+    int startColumn = 0;
+    int endLine = 0;
+    int endColumn = 0;
+};
+
 /**
  * Expression.
  */
 struct Exp {
     ExpType type;
 
-    int number;
+    Span span;
+
+    int64_t number;
     std::string string;
     std::vector<Exp> list;
 
     // Numbers:
-    Exp(int number): type(ExpType::NUMBER), number(number) {}
+    Exp(int64_t number): type(ExpType::NUMBER), number(number) {}
 
 
     // Strings, Symbols:
@@ -87,10 +102,22 @@ struct Exp {
     }
 
     // Lists:
-    Exp(std::vector<Exp> list): type(ExpType::LIST), list(list) {}
+    Exp(std::vector<Exp> list): type(ExpType::LIST), list(std::move(list)) {}
 
 };
 
+/**
+ * Value of an integer literal: a literal out of the int64
+ * range is a syntax error.
+ */
+inline int64_t parseInteger(const std::string& literal) {
+    try {
+        return std::stoll(literal);
+    } catch (const std::out_of_range&) {
+        throw std::runtime_error("Syntax Error: integer literal out of range: " + literal);
+    }
+}
+
 using Value = Exp;  // clang-format on
 
 namespace syntax {
@@ -167,9 +194,10 @@ enum TokenizerState {
 class Tokenizer {
  public:
   /**
-   * Initializes a parsing string.
+   * Initializes a parsing string. The string is scanned
+   * in place, and must outlive the tokenizing.
    */
-  void initString(const std::string& str) {
+  void initString(std::string_view str, int firstLine = 1) {
     str_ = str;
 
     // Initialize states.
@@ -177,7 +205,7 @@ class Tokenizer {
     states_.push_back(TokenizerState::INITIAL);
 
     cursor_ = 0;
-    currentLine_ = 1;
+    currentLine_ = firstLine;
     currentColumn_ = 0;
     currentLineBeginOffset_ = 0;
 
@@ -229,13 +257,16 @@ class Tokenizer {
 
     auto strSlice = str_.substr(cursor_);
 
-    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
+    const auto& lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
 
     for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
-      std::smatch sm;
+      const auto& rule = lexRules_[ruleIndex];
+      std::cmatch sm;
 
-      if (std::regex_search(strSlice, sm, rule.regex)) {
+      // The rules are anchored: match only at the cursor, instead of
+      // trying (and failing) at every position to the end of the input.
+      if (std::regex_search(strSlice.data(), strSlice.data() + strSlice.size(), sm, rule.regex,
+                            std::regex_constants::match_continuous)) {
         yytext = sm[0];
 
         captureLocations_(yytext);
@@ -292,7 +323,7 @@ class Tokenizer {
    */
   [[noreturn]] void throwUnexpectedToken(const std::string& symbol, int line,
                                          int column) {
-    std::stringstream ss{str_};
+    std::stringstream ss{std::string(str_)};
     std::string lineStr;
     int currentLine = 1;
 
@@ -333,13 +364,11 @@ class Tokenizer {
     tokenStartColumn_ = tokenStartOffset_ - currentLineBeginOffset_;
 
     // Extract `\n` in the matched token.
-    std::stringstream ss{matched};
-    std::string lineStr;
-    std::getline(ss, lineStr, '\n');
-    while (ss.tellg() > 0 && ss.tellg() <= len) {
-      currentLine_++;
-      currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
-      std::getline(ss, lineStr, '\n');
+    for (size_t i = 0; i < len; i++) {
+      if (matched[i] == '\n') {
+        currentLine_++;
+        currentLineBeginOffset_ = tokenStartOffset_ + i + 1;
+      }
     }
 
     tokenEndOffset_ = cursor_ + len;
@@ -367,7 +396,7 @@ class Tokenizer {
   /**
    * Tokenizing string.
    */
-  std::string str_;
+  std::string_view str_;
 
   /**
    * Cursor for current symbol.
@@ -456,16 +485,16 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
 #endif
 // clang-format on
 
-#define POP_V()              \
-  parser.valuesStack.back(); \
+#define POP_V()                         \
+  std::move(parser.valuesStack.back()); \
   parser.valuesStack.pop_back()
 
-#define POP_T()              \
-  parser.tokensStack.back(); \
+#define POP_T()                         \
+  std::move(parser.tokensStack.back()); \
   parser.tokensStack.pop_back()
 
-#define PUSH_VR() parser.valuesStack.push_back(__)
-#define PUSH_TR() parser.tokensStack.push_back(__)
+#define PUSH_VR() parser.valuesStack.push_back(std::move(__))
+#define PUSH_TR() parser.tokensStack.push_back(std::move(__))
 
 /**
  * Parsing table type.
@@ -478,12 +507,18 @@ enum class TE {
 };
 
 /**
- * Parsing table entry.
+ * Parsing table entry: the state (Shift, Transit) or the production
+ * (Reduce) number, shifted left by 2 over the entry type.
  */
-struct TableEntry {
-  TE type;
-  int value;
-};
+using TableEntry = int16_t;
+
+/**
+ * No entry: a syntax error.
+ */
+const TableEntry NO_ENTRY = -1;
+
+inline TE entryType(TableEntry entry) { return (TE)(entry & 3); }
+inline int entryValue(TableEntry entry) { return entry >> 2; }
 
 // clang-format off
 class EvaParser;
@@ -505,10 +540,6 @@ struct Production {
   ProductionHandler handler;
 };
 
-// Key: Encoded symbol (terminal or non-terminal) index
-// Value: TableEntry
-using Row = std::map<int, TableEntry>;
-
 /**
  * Parser class.
  */
@@ -531,6 +562,16 @@ class EvaParser {
    */
   std::vector<int> statesStack;
 
+  /**
+   * Locations stack, parallel to the symbols on the states stack.
+   */
+  std::vector<Span> locationsStack;
+
+  /**
+   * Location of the production being reduced.
+   */
+  Span yyloc;
+
   /**
    * Tokenizer.
    */
@@ -542,83 +583,99 @@ class EvaParser {
   int previousState;
 
   /**
-   * Parses a string.
+   * Parses a string. The tokenizer scans it in place, so
+   * e.g. a mapped source file is never copied. Lines of the
+   * locations are counted from `firstLine`.
    */
-  Value parse(const std::string& str) {
+  Value parse(std::string_view str, int firstLine = 1) {
     // clang-format off
     
     // clang-format on
 
     // Initialize the tokenizer and the string.
-    tokenizer.initString(str);
+    tokenizer.initString(str, firstLine);
 
     // Initialize the stacks.
     valuesStack.clear();
     tokensStack.clear();
     statesStack.clear();
+    locationsStack.clear();
 
     // Initial 0 state.
     statesStack.push_back(0);
 
     auto token = tokenizer.getNextToken();
-    auto shiftedToken = token;
 
     // Main parsing loop.
     for (;;) {
       auto state = statesStack.back();
       auto column = (int)token->type;
 
-      if (table_[state].count(column) == 0) {
+      auto entry = table_[state][column];
+
+      if (entry == NO_ENTRY) {
         throwUnexpectedToken(token);
       }
 
-      auto entry = table_[state].at(column);
+      auto type = entryType(entry);
 
       // Shift a token, go to state.
-      if (entry.type == TE::Shift) {
-        // Push token.
-        tokensStack.push_back(token->value);
+      if (type == TE::Shift) {
+        locationsStack.push_back({token->startLine, token->startColumn,
+                                  token->endLine, token->endColumn});
+
+        // Push token (the token itself is not used anymore).
+        tokensStack.push_back(std::move(token->value));
 
         // Push next state number: "s5" -> 5
-        statesStack.push_back(entry.value);
+        statesStack.push_back(entryValue(entry));
 
-        shiftedToken = token;
         token = tokenizer.getNextToken();
       }
 
       // Reduce by production.
-      else if (entry.type == TE::Reduce) {
-        auto productionNumber = entry.value;
-        auto production = productions_[productionNumber];
-
-        tokenizer.yytext = shiftedToken->value;
+      else if (type == TE::Reduce) {
+        auto& production = productions_[entryValue(entry)];
 
         auto rhsLength = production.rhsLength;
-        while (rhsLength > 0) {
-          statesStack.pop_back();
-          rhsLength--;
+
+        // The production spans its RHS symbols; an empty one is
+        // located at the lookahead.
+        if (rhsLength > 0) {
+          auto& first = locationsStack[locationsStack.size() - rhsLength];
+          auto& last = locationsStack.back();
+          yyloc = {first.startLine, first.startColumn, last.endLine, last.endColumn};
+        } else {
+          yyloc = {token->startLine, token->startColumn,
+                   token->startLine, token->startColumn};
         }
 
+        statesStack.resize(statesStack.size() - rhsLength);
+        locationsStack.resize(locationsStack.size() - rhsLength);
+
         // Call the handler.
         production.handler(*this);
 
+        valuesStack.back().span = yyloc;
+        locationsStack.push_back(yyloc);
+
         auto previousState = statesStack.back();
 
         auto symbolToReduceWith = production.opcode;
-        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
-        assert(nextStateEntry.type == TE::Transit);
+        auto nextStateEntry = table_[previousState][symbolToReduceWith];
+        assert(entryType(nextStateEntry) == TE::Transit);
 
-        statesStack.push_back(nextStateEntry.value);
+        statesStack.push_back(entryValue(nextStateEntry));
       }
 
       // Accept the string.
-      else if (entry.type == TE::Accept) {
+      else if (type == TE::Accept) {
         // Pop state number.
         statesStack.pop_back();
 
         // Pop the parsed value.
         // clang-format off
-        auto result = valuesStack.back(); valuesStack.pop_back();
+        auto result = std::move(valuesStack.back()); valuesStack.pop_back();
         // clang-format on
 
         if (statesStack.size() != 1 || statesStack.back() != 0 ||
@@ -656,7 +713,8 @@ class EvaParser {
   static std::array<Production, PRODUCTIONS_COUNT> productions_;
 
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static constexpr size_t SYMBOLS_COUNT = 10;
+  static std::array<std::array<TableEntry, SYMBOLS_COUNT>, ROWS_COUNT> table_;
   // clang-format on
 };
 
@@ -701,7 +759,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1))  ;
+auto __ = Exp(parseInteger(_1))  ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -736,7 +794,7 @@ parser.tokensStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
 
-auto __ = _2 ;
+auto __ = std::move(_2) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -759,7 +817,7 @@ void _handler9(yyparse& parser) {
 auto _2 = POP_V();
 auto _1 = POP_V();
 
-_1.list.push_back(_2); auto __ = _1 ;
+_1.list.push_back(std::move(_2)); auto __ = std::move(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -783,19 +841,30 @@ std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1
 // Parsing table.
 
 // clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
-    Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
-    Row {{9, {TE::Accept, 0}}},
-    Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
-    Row {{4, {TE::Reduce, 2}}, {5, {TE::Reduce, 2}}, {6, {TE::Reduce, 2}}, {7, {TE::Reduce, 2}}, {8, {TE::Reduce, 2}}, {9, {TE::Reduce, 2}}},
-    Row {{4, {TE::Reduce, 3}}, {5, {TE::Reduce, 3}}, {6, {TE::Reduce, 3}}, {7, {TE::Reduce, 3}}, {8, {TE::Reduce, 3}}, {9, {TE::Reduce, 3}}},
-    Row {{4, {TE::Reduce, 4}}, {5, {TE::Reduce, 4}}, {6, {TE::Reduce, 4}}, {7, {TE::Reduce, 4}}, {8, {TE::Reduce, 4}}, {9, {TE::Reduce, 4}}},
-    Row {{4, {TE::Reduce, 5}}, {5, {TE::Reduce, 5}}, {6, {TE::Reduce, 5}}, {7, {TE::Reduce, 5}}, {8, {TE::Reduce, 5}}, {9, {TE::Reduce, 5}}},
-    Row {{3, {TE::Transit, 8}}, {4, {TE::Reduce, 7}}, {5, {TE::Reduce, 7}}, {6, {TE::Reduce, 7}}, {7, {TE::Reduce, 7}}, {8, {TE::Reduce, 7}}},
-    Row {{0, {TE::Transit, 10}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}, {8, {TE::Shift, 9}}},
-    Row {{4, {TE::Reduce, 6}}, {5, {TE::Reduce, 6}}, {6, {TE::Reduce, 6}}, {7, {TE::Reduce, 6}}, {8, {TE::Reduce, 6}}, {9, {TE::Reduce, 6}}},
-    Row {{4, {TE::Reduce, 8}}, {5, {TE::Reduce, 8}}, {6, {TE::Reduce, 8}}, {7, {TE::Reduce, 8}}, {8, {TE::Reduce, 8}}}
-};
+std::array<std::array<TableEntry, yyparse::SYMBOLS_COUNT>, yyparse::ROWS_COUNT> yyparse::table_ = {{
+#define S(n) TableEntry((n) << 2 | (int)TE::Shift)
+#define R(n) TableEntry((n) << 2 | (int)TE::Reduce)
+#define T(n) TableEntry((n) << 2 | (int)TE::Transit)
+#define ACC TableEntry((int)TE::Accept)
+#define ___ NO_ENTRY
+    //   Exp   Atom   List   Ents    NUM    STR    SYM    '('    ')'      $
+    { T(1),  T(2),  T(3),   ___,  S(4),  S(5),  S(6),  S(7),   ___,   ___},
+    {  ___,   ___,   ___,   ___,   ___,   ___,   ___,   ___,   ___,   ACC},
+    {  ___,   ___,   ___,   ___,  R(1),  R(1),  R(1),  R(1),  R(1),  R(1)},
+    {  ___,   ___,   ___,   ___,  R(2),  R(2),  R(2),  R(2),  R(2),  R(2)},
+    {  ___,   ___,   ___,   ___,  R(3),  R(3),  R(3),  R(3),  R(3),  R(3)},
+    {  ___,   ___,   ___,   ___,  R(4),  R(4),  R(4),  R(4),  R(4),  R(4)},
+    {  ___,   ___,   ___,   ___,  R(5),  R(5),  R(5),  R(5),  R(5),  R(5)},
+    {  ___,   ___,   ___,  T(8),  R(7),  R(7),  R(7),  R(7),  R(7),   ___},
+    {T(10),  T(2),  T(3),   ___,  S(4),  S(5),  S(6),  S(7),  S(9),   ___},
+    {  ___,   ___,   ___,   ___,  R(6),  R(6),  R(6),  R(6),  R(6),  R(6)},
+    {  ___,   ___,   ___,   ___,  R(8),  R(8),  R(8),  R(8),  R(8),   ___}
+#undef S
+#undef R
+#undef T
+#undef ACC
+#undef ___
+}};
 // clang-format on
 
 }  // namespace syntax
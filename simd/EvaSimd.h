@@ -0,0 +1,308 @@
+//
+// Created by Retros on 2023/4/22.
+//
+
+#ifndef RETROSEVAVM_EVASIMD_H
+#define RETROSEVAVM_EVASIMD_H
+
+#include <algorithm>
+#include <cstddef>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define EVA_SIMD_X86
+#endif
+
+/**
+ * Bulk kernels over contiguous doubles.
+ *
+ * Every kernel has a scalar version, an SSE2 version (the x86-64
+ * baseline), and an AVX2 version compiled with a target attribute, so
+ * the binary runs on any x86-64. The widest version the CPU supports
+ * is chosen once, at the first use (CPUID).
+ *
+ * The vectorized sums add in a different order than the scalar loop,
+ * so the results may differ in the last bits.
+ */
+struct SimdKernels {
+    const char* name;
+
+    double (*sum)(const double* a, size_t n);
+    double (*dot)(const double* a, const double* b, size_t n);
+    double (*min)(const double* a, size_t n);
+    double (*max)(const double* a, size_t n);
+    void (*add)(const double* a, const double* b, double* out, size_t n);
+    void (*mul)(const double* a, const double* b, double* out, size_t n);
+};
+
+// ------------------------------------------------------------
+// Scalar:
+
+namespace scalar {
+
+double sum(const double* a, size_t n) {
+    double result = 0;
+    for (size_t i = 0; i < n; i++) {
+        result += a[i];
+    }
+    return result;
+}
+
+double dot(const double* a, const double* b, size_t n) {
+    double result = 0;
+    for (size_t i = 0; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+double min(const double* a, size_t n) {
+    double result = a[0];
+    for (size_t i = 1; i < n; i++) {
+        result = std::min(result, a[i]);
+    }
+    return result;
+}
+
+double max(const double* a, size_t n) {
+    double result = a[0];
+    for (size_t i = 1; i < n; i++) {
+        result = std::max(result, a[i]);
+    }
+    return result;
+}
+
+void add(const double* a, const double* b, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+void mul(const double* a, const double* b, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+}  // namespace scalar
+
+#ifdef EVA_SIMD_X86
+
+// ------------------------------------------------------------
+// SSE2 (2 lanes):
+
+namespace sse2 {
+
+double horizontalSum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+double sum(const double* a, size_t n) {
+    // Two accumulators hide the latency of the additions.
+    auto acc0 = _mm_setzero_pd();
+    auto acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+    auto result = horizontalSum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        result += a[i];
+    }
+    return result;
+}
+
+double dot(const double* a, const double* b, size_t n) {
+    auto acc0 = _mm_setzero_pd();
+    auto acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    auto result = horizontalSum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+double min(const double* a, size_t n) {
+    if (n < 2) {
+        return scalar::min(a, n);
+    }
+    auto acc = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        acc = _mm_min_pd(acc, _mm_loadu_pd(a + i));
+    }
+    auto result = std::min(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    for (; i < n; i++) {
+        result = std::min(result, a[i]);
+    }
+    return result;
+}
+
+double max(const double* a, size_t n) {
+    if (n < 2) {
+        return scalar::max(a, n);
+    }
+    auto acc = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2) {
+        acc = _mm_max_pd(acc, _mm_loadu_pd(a + i));
+    }
+    auto result = std::max(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    for (; i < n; i++) {
+        result = std::max(result, a[i]);
+    }
+    return result;
+}
+
+void add(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+void mul(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+}  // namespace sse2
+
+// ------------------------------------------------------------
+// AVX2 (4 lanes):
+
+#define EVA_AVX2 __attribute__((target("avx2")))
+
+namespace avx2 {
+
+EVA_AVX2 double horizontalSum(__m256d v) {
+    auto sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+EVA_AVX2 double sum(const double* a, size_t n) {
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    auto result = horizontalSum(_mm256_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        result += a[i];
+    }
+    return result;
+}
+
+EVA_AVX2 double dot(const double* a, const double* b, size_t n) {
+    auto acc0 = _mm256_setzero_pd();
+    auto acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    auto result = horizontalSum(_mm256_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+EVA_AVX2 double min(const double* a, size_t n) {
+    if (n < 4) {
+        return scalar::min(a, n);
+    }
+    auto acc = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    auto result = scalar::min(lanes, 4);
+    for (; i < n; i++) {
+        result = std::min(result, a[i]);
+    }
+    return result;
+}
+
+EVA_AVX2 double max(const double* a, size_t n) {
+    if (n < 4) {
+        return scalar::max(a, n);
+    }
+    auto acc = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    auto result = scalar::max(lanes, 4);
+    for (; i < n; i++) {
+        result = std::max(result, a[i]);
+    }
+    return result;
+}
+
+EVA_AVX2 void add(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+EVA_AVX2 void mul(const double* a, const double* b, double* out, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+}  // namespace avx2
+
+#undef EVA_AVX2
+
+#endif
+
+/**
+ * Returns the kernels for this CPU.
+ */
+const SimdKernels& simdKernels() {
+    static const SimdKernels kernels = []() -> SimdKernels {
+#ifdef EVA_SIMD_X86
+        // CPUID (also checks that the OS saves the AVX state).
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {"avx2", avx2::sum, avx2::dot, avx2::min, avx2::max, avx2::add, avx2::mul};
+        }
+        return {"sse2", sse2::sum, sse2::dot, sse2::min, sse2::max, sse2::add, sse2::mul};
+#else
+        return {"scalar", scalar::sum, scalar::dot, scalar::min, scalar::max, scalar::add, scalar::mul};
+#endif
+    }();
+    return kernels;
+}
+
+#endif //RETROSEVAVM_EVASIMD_H
@@ -0,0 +1,52 @@
+# Differential test: runs a script as is and with FLAGS,
+# and fails unless both succeed with the same output.
+# With EXPECTED instead, the output must be the one in that file.
+#
+#   cmake -DVM=<RetrosEvaVM> -DSCRIPT=<file.eva> -DFLAGS=<flags> -P CompareRuns.cmake
+#   cmake -DVM=<RetrosEvaVM> -DSCRIPT=<file.eva> -DEXPECTED=<file> -P CompareRuns.cmake
+#
+# The disassembly printed before each form is left out:
+# the flags may change the bytecode, not what the script does.
+
+function(run_script output)
+    execute_process(
+        COMMAND ${VM} ${ARGN} ${SCRIPT}
+        OUTPUT_VARIABLE out
+        ERROR_VARIABLE err
+        RESULT_VARIABLE code)
+    if (NOT code EQUAL 0)
+        message(FATAL_ERROR "${VM} ${ARGN} ${SCRIPT} failed (${code}):\n${err}")
+    endif ()
+
+    string(REPLACE ";" "\\;" out "${out}")
+    string(REPLACE "\n" ";" lines "${out}")
+    set(kept "")
+    foreach (line IN LISTS lines)
+        # Instructions, their operand lines, and the headers.
+        if (NOT line MATCHES "^([0-9A-F][0-9A-F][0-9A-F][0-9A-F] | |-+ Disassembly|$)")
+            string(APPEND kept "${line}\n")
+        endif ()
+    endforeach ()
+    set(${output} "${kept}" PARENT_SCOPE)
+endfunction()
+
+if (DEFINED EXPECTED)
+    file(READ ${EXPECTED} expected)
+    run_script(actual)
+
+    if (NOT expected STREQUAL actual)
+        message(FATAL_ERROR "${SCRIPT}: output differs from ${EXPECTED}\n"
+                "--- expected:\n${expected}--- actual:\n${actual}")
+    endif ()
+    return()
+endif ()
+
+separate_arguments(FLAGS)
+
+run_script(expected)
+run_script(actual ${FLAGS})
+
+if (NOT expected STREQUAL actual)
+    message(FATAL_ERROR "${SCRIPT}: output differs with ${FLAGS}\n"
+            "--- expected:\n${expected}--- with ${FLAGS}:\n${actual}")
+endif ()
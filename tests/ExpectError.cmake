@@ -0,0 +1,33 @@
+# Error test: runs a script as is and with FLAGS, and fails unless
+# both stop with the error on the script's first line:
+#
+#   // Expected: <message>
+#
+#   cmake -DVM=<RetrosEvaVM> -DSCRIPT=<file.eva> -DFLAGS=<flags> -P ExpectError.cmake
+
+file(STRINGS ${SCRIPT} header LIMIT_COUNT 1)
+if (NOT header MATCHES "^// Expected: (.+)$")
+    message(FATAL_ERROR "${SCRIPT}: no \"// Expected: <message>\" line")
+endif ()
+set(expected "Fatal error: ${CMAKE_MATCH_1}")
+
+function(expect_error)
+    execute_process(
+        COMMAND ${VM} ${ARGN} ${SCRIPT}
+        OUTPUT_QUIET
+        ERROR_VARIABLE err
+        RESULT_VARIABLE code)
+    # A crash is reported as a string, not the exit code of DIE.
+    if (NOT code EQUAL 1)
+        message(FATAL_ERROR "${VM} ${ARGN} ${SCRIPT} exited with ${code}:\n${err}")
+    endif ()
+    string(FIND "${err}" "${expected}" found)
+    if (found EQUAL -1)
+        message(FATAL_ERROR "${VM} ${ARGN} ${SCRIPT}: expected\n${expected}\ngot:\n${err}")
+    endif ()
+endfunction()
+
+separate_arguments(FLAGS)
+
+expect_error()
+expect_error(${FLAGS})
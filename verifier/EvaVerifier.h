@@ -0,0 +1,318 @@
+//
+// Created by Retros on 2023/4/29.
+//
+
+#ifndef RETROSEVAVM_EVAVERIFIER_H
+#define RETROSEVAVM_EVAVERIFIER_H
+
+#include "../OpCode.h"
+#include "../EvaValue.h"
+#include "../Global.h"
+#include "../Logger.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+/**
+ * Bytecode verifier.
+ *
+ * Checks a code object once, before it runs, so that the interpreter
+ * can execute it without per-instruction checks:
+ *
+ *  - the code is a sequence of valid instructions, and the control
+ *    never falls off its end;
+ *  - constant, global, switch table, comparison and upvalue operands
+ *    are in range, and jump targets are on instruction boundaries;
+ *  - a function body is left by RETURN, the top-level code by HALT;
+ *  - the stack depth is the same on every path to an instruction,
+ *    it covers the values the instruction reads, and local variables
+ *    (including the captured ones) are slots below it. A function
+ *    starts with its arguments on the stack.
+ *
+ * The verified code object gets its maximum stack depth (the space
+ * the VM reserves for it), and is marked as verified.
+ */
+class EvaVerifier {
+public:
+    EvaVerifier(std::shared_ptr<Global> global) : global(global) {}
+
+    /**
+     * Verifies the code object, fails with an error if it's invalid.
+     */
+    void verify(CodeObject* co) {
+        this->co = co;
+        co->verified = false;
+
+        if (co->code.empty()) {
+            DIE << "[EvaVerifier]: " << co->name << ": empty code";
+        }
+
+        findInstructions();
+
+        for (size_t offset = 0; offset < co->code.size(); offset += instructionSize(&co->code[offset])) {
+            verifyOperands(offset);
+        }
+
+        co->maxStackDepth = analyzeStackDepth();
+        co->verified = true;
+    }
+
+private:
+    /**
+     * Marks the offsets where instructions start.
+     */
+    void findInstructions() {
+        instructionStarts.assign(co->code.size(), false);
+
+        size_t offset = 0;
+        while (offset < co->code.size()) {
+            auto instruction = &co->code[offset];
+            if (!isValidOpcode(*instruction)) {
+                DIE << "[EvaVerifier]: " << co->name << ": invalid opcode " << (int)*instruction
+                    << " at " << offset;
+            }
+            // The size of a closure is in its operands.
+            auto isTruncated = *instruction == OP_CLOSURE && offset + 3 > co->code.size();
+            if (isTruncated || offset + instructionSize(instruction) > co->code.size()) {
+                DIE << "[EvaVerifier]: " << co->name << ": truncated " << opcodeToString(*instruction)
+                    << " at " << offset;
+            }
+            instructionStarts[offset] = true;
+            offset += instructionSize(instruction);
+        }
+    }
+
+    /**
+     * Checks the operands that don't depend on the stack.
+     */
+    void verifyOperands(size_t offset) {
+        auto instruction = &co->code[offset];
+        switch (*instruction) {
+            case OP_CONST:
+                checkIndex(offset, instruction[1], co->constants.size(), "constant");
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+                checkIndex(offset, instruction[1], global->globals.size(), "global");
+                break;
+            case OP_COMPARE:
+            case OP_COMPARE_NUM:
+                // Index of the operator in COMPARE_VALUES.
+                checkIndex(offset, instruction[1], 6, "comparison");
+                break;
+            case OP_JMP:
+            case OP_JMP_IF_FALSE:
+            case OP_JMP_IF_TRUE:
+                checkTarget(offset, readAddress(offset + 1));
+                break;
+            case OP_HALT:
+            case OP_RETURN:
+                if ((*instruction == OP_RETURN) != co->isFunction) {
+                    DIE << "[EvaVerifier]: " << co->name << ": " << opcodeToString(*instruction) << " at "
+                        << offset << " in " << (co->isFunction ? "a function" : "top-level code");
+                }
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                checkIndex(offset, instruction[1], co->upvalues.size(), "upvalue");
+                if (*instruction == OP_SET_UPVALUE && !co->upvalues[instruction[1]].isBoxed) {
+                    DIE << "[EvaVerifier]: " << co->name << ": OP_SET_UPVALUE at " << offset
+                        << ": upvalue " << (int)instruction[1] << " is not boxed";
+                }
+                break;
+            case OP_CLOSURE: {
+                checkIndex(offset, instruction[1], co->constants.size(), "constant");
+                auto& constant = co->constants[instruction[1]];
+                if (!IS_CODE(constant) || !AS_CODE(constant)->isFunction ||
+                    AS_CODE(constant)->upvalues.size() != instruction[2]) {
+                    DIE << "[EvaVerifier]: " << co->name << ": OP_CLOSURE at " << offset
+                        << ": not a function with " << (int)instruction[2] << " upvalues";
+                }
+                for (size_t i = 0; i < instruction[2]; i++) {
+                    if (!instruction[3 + 2 * i]) {
+                        checkIndex(offset, instruction[4 + 2 * i], co->upvalues.size(), "upvalue");
+                    }
+                }
+                break;
+            }
+            case OP_LOOP_INC_LT:
+                checkTarget(offset, readAddress(offset + 2));
+                break;
+            case OP_TABLE_SWITCH:
+            case OP_LOOKUP_SWITCH: {
+                checkIndex(offset, instruction[1], co->switchTables.size(), "switch table");
+                auto& table = co->switchTables[instruction[1]];
+                for (auto target : switchTargets(table)) {
+                    checkTarget(offset, target);
+                }
+
+                // Lookups are binary searches.
+                auto sorted = [](auto& cases) {
+                    return std::adjacent_find(cases.begin(), cases.end(), [](auto& a, auto& b) {
+                               return !(a.first < b.first);
+                           }) == cases.end();
+                };
+                if (!sorted(table.intCases) || !sorted(table.stringCases)) {
+                    DIE << "[EvaVerifier]: " << co->name << ": unsorted switch cases at " << offset;
+                }
+                break;
+            }
+        }
+    }
+
+    /**
+     * Computes the stack depth before each reachable instruction,
+     * and returns the maximum.
+     */
+    size_t analyzeStackDepth() {
+        // Depth before each instruction, -1 if not reached yet.
+        std::vector<int> depths(co->code.size(), -1);
+        std::vector<size_t> worklist = {0};
+        depths[0] = (int)co->arity;
+
+        int maxDepth = depths[0];
+
+        auto flowTo = [&](size_t offset, int depth) {
+            // Targets are instruction starts (see verifyOperands),
+            // so only a fall-through can leave the code.
+            if (offset >= co->code.size()) {
+                DIE << "[EvaVerifier]: " << co->name << ": control falls off the end of the code";
+            }
+            if (depths[offset] == -1) {
+                depths[offset] = depth;
+                worklist.push_back(offset);
+            } else if (depths[offset] != depth) {
+                DIE << "[EvaVerifier]: " << co->name << ": inconsistent stack depth at " << offset
+                    << ": " << depths[offset] << " and " << depth;
+            }
+        };
+
+        while (!worklist.empty()) {
+            auto offset = worklist.back();
+            worklist.pop_back();
+
+            auto instruction = &co->code[offset];
+            auto next = offset + instructionSize(instruction);
+
+            if (depths[offset] < stackInputs(instruction)) {
+                DIE << "[EvaVerifier]: " << co->name << ": stack underflow at " << offset;
+            }
+            checkLocals(offset, depths[offset]);
+
+            auto depth = depths[offset] + stackEffect(instruction);
+            maxDepth = std::max(maxDepth, depth);
+
+            switch (*instruction) {
+                case OP_HALT:
+                case OP_RETURN:
+                    break;
+                case OP_JMP:
+                    flowTo(readAddress(offset + 1), depth);
+                    break;
+                case OP_JMP_IF_FALSE:
+                case OP_JMP_IF_TRUE:
+                    flowTo(readAddress(offset + 1), depth);
+                    flowTo(next, depth);
+                    break;
+                case OP_LOOP_INC_LT:
+                    flowTo(readAddress(offset + 2), depth);
+                    flowTo(next, depth);
+                    break;
+                case OP_TABLE_SWITCH:
+                case OP_LOOKUP_SWITCH:
+                    for (auto target : switchTargets(co->switchTables[instruction[1]])) {
+                        flowTo(target, depth);
+                    }
+                    break;
+                default:
+                    flowTo(next, depth);
+            }
+        }
+
+        return (size_t)maxDepth;
+    }
+
+    /**
+     * Local variables are the stack slots from the frame base:
+     * an accessed local must be below the stack top.
+     */
+    void checkLocals(size_t offset, int depth) {
+        auto instruction = &co->code[offset];
+        switch (*instruction) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                checkIndex(offset, instruction[1], depth, "local");
+                break;
+            case OP_LOOP_INC_LT:
+                // The counter, the end and the step.
+                checkIndex(offset, instruction[1] + 2, depth, "local");
+                break;
+            case OP_GET_BOXED:
+            case OP_SET_BOXED:
+                // Whether the slot holds a box is checked when it runs.
+                checkIndex(offset, instruction[1], depth, "local");
+                break;
+            case OP_CLOSURE:
+                for (size_t i = 0; i < instruction[2]; i++) {
+                    if (instruction[3 + 2 * i]) {
+                        checkIndex(offset, instruction[4 + 2 * i], depth, "local");
+                    }
+                }
+                break;
+        }
+    }
+
+    void checkIndex(size_t offset, size_t index, size_t count, const char* kind) {
+        if (index >= count) {
+            DIE << "[EvaVerifier]: " << co->name << ": " << opcodeToString(co->code[offset]) << " at "
+                << offset << ": " << kind << " " << index << " out of range (" << count << ")";
+        }
+    }
+
+    void checkTarget(size_t offset, size_t target) {
+        if (target >= co->code.size() || !instructionStarts[target]) {
+            DIE << "[EvaVerifier]: " << co->name << ": " << opcodeToString(co->code[offset]) << " at "
+                << offset << ": invalid jump target " << target;
+        }
+    }
+
+    /**
+     * All the targets of a switch table, including the default.
+     */
+    static std::vector<uint16_t> switchTargets(const SwitchTable& table) {
+        std::vector<uint16_t> targets = table.targets;
+        for (auto& entry : table.intCases) {
+            targets.push_back(entry.second);
+        }
+        for (auto& entry : table.stringCases) {
+            targets.push_back(entry.second);
+        }
+        targets.push_back(table.defaultTarget);
+        return targets;
+    }
+
+    /**
+     * Reads a 2-byte address operand.
+     */
+    uint16_t readAddress(size_t offset) {
+        return (uint16_t)((co->code[offset] << 8) | co->code[offset + 1]);
+    }
+
+    /**
+     * Global object (the global operands index it).
+     */
+    std::shared_ptr<Global> global;
+
+    /**
+     * Code object being verified.
+     */
+    CodeObject* co = nullptr;
+
+    /**
+     * Whether an instruction starts at each offset.
+     */
+    std::vector<bool> instructionStarts;
+};
+
+#endif //RETROSEVAVM_EVAVERIFIER_H